@@ -1,6 +1,14 @@
+#define _POSIX_C_SOURCE 200809L   /* strdup(), sysconf() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
 
 /* ******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
@@ -15,17 +23,307 @@
      (although some can be lost).
 **********************************************************************/
 
-#define BIDIRECTIONAL 1
+/* everything a simulation run changes is SIMSTATE, i.e. thread-local, so */
+/* the worker threads of a parameter sweep each run their own simulation  */
+#define SIMSTATE _Thread_local
+
+/* the simulation clock.  A float clock loses the fraction of a time unit */
+/* after about 10^6 units and events pile up on the same timestamps, so   */
+/* it is a double; build with -DSIMCLOCK=float for the original clock.    */
+#ifndef SIMCLOCK
+#define  SIMCLOCK        double
+#endif
+typedef SIMCLOCK simclock;
+
+/* a packet is the data unit passed from layer 4 (students code) to layer */
+/* 3 (teachers code).  Note the pre-defined packet structure, which all   */
+/* students must follow. */
+#ifndef MSS_MAX
+#define  MSS_MAX         1024  /* largest -mss: payload bytes a packet holds */
+#endif
+struct pkt {
+   int seqnum;
+   int acknum;
+   int checksum;
+   int isACK;
+   int length;             /* payload bytes used */
+   int more;               /* 1: more segments of the same message follow */
+   int conn;               /* connection, see ep_init() */
+   char *payload;          /* a pktbuf_alloc() buffer, NULL if length is 0 */
+};
+/* on the wire a packet is packed into a frame (see pkt_serialize): its */
+/* connection in CONN_BYTES (none while there is only one), seqnum and  */
+/* acknum in SEQ_BYTES each, big-endian, a flags byte, the 16-bit       */
+/* checksum, then the payload, which runs to the end of the frame       */
+#define  CONN_BYTES      connbytes
+#define  CONN_MAX        (1 << 24)  /* connections CONN_BYTES can number */
+#define  SEQ_BYTES       ((SEQBITS + 7) / 8)
+#define  WIRE_HDR        (CONN_BYTES + 2*SEQ_BYTES + 3)
+#define  WIRE_HDR_MAX    (3 + 2*4 + 3)
+#define  WF_ACK          1     /* isACK */
+#define  WF_NAK          2     /* an ACK with acknum -1 */
+#define  WF_MORE         4     /* more */
+/* bytes of packet p on the wire: the header and the payload used */
+#define  PKT_BYTES(p)    (WIRE_HDR + (p).length)
 
 struct event {
-   float evtime;           /* event time */
+   simclock evtime;        /* event time */
    int evtype;             /* event type code */
-   int eventity;           /* entity where event occurs */
-   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
+   int eventity;           /* entity (FROM_LAYER3) or endpoint where event occurs */
+   int evsrc;              /* entity that sent the packet (FROM_LAYER3) */
+   int wirelen;            /* bytes of the frame (FROM_LAYER3) */
    struct event *prev;
-   struct event *next;
+   struct event *next;     /* also links free events in the pool */
+   unsigned long evseq;    /* insertion order, used to break evtime ties */
+   int heapidx;            /* slot in evheap (EVQUEUE_HEAP only) */
+   struct event **evslot;  /* the wheel slot list it is on (TIMERQ_WHEEL), or NULL */
+   char *payload;          /* the frame's payload, a reference held, or NULL */
+   unsigned char hdr[WIRE_HDR_MAX]; /* the frame's header */
+};
+
+/* event scheduler: pick one at compile time with -DEVQUEUE=... */
+#define  EVQUEUE_LIST    0     /* sorted doubly linked list, O(n) insert */
+#define  EVQUEUE_HEAP    1     /* binary min-heap, O(log n) insert/remove */
+#ifndef EVQUEUE
+#define  EVQUEUE         EVQUEUE_HEAP
+#endif
+
+/* where timers wait: pick one at compile time with -DTIMERQ=...  The    */
+/* wheel keeps a timer in a slot list until the clock nears its tick and */
+/* only then puts it on the heap, so the many timers that are stopped    */
+/* early never touch the heap.  Events come out in the same order.       */
+#define  TIMERQ_HEAP     0     /* on the event queue with everything else */
+#define  TIMERQ_WHEEL    1     /* two-level timing wheel, O(1) start/stop */
+#ifndef TIMERQ
+#define  TIMERQ          TIMERQ_HEAP
+#endif
+#if TIMERQ == TIMERQ_WHEEL && EVQUEUE != EVQUEUE_HEAP
+#error the timing wheel feeds the event heap, build it with EVQUEUE_HEAP
+#endif
+#define  WHEEL_BITS      8
+#define  WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define  WHEEL_TICK      1.0   /* time units a level 0 slot covers */
+
+SIMSTATE struct event *evlist = NULL;   /* the event list (EVQUEUE_LIST) */
+SIMSTATE struct event **evheap = NULL;  /* the event heap (EVQUEUE_HEAP) */
+SIMSTATE int evheapsize = 0;            /* events currently in evheap */
+SIMSTATE int evheapmax = 0;             /* allocated slots in evheap */
+SIMSTATE unsigned long evcount = 0;     /* events inserted so far */
+SIMSTATE unsigned long evremoves = 0;   /* events taken off the queue so far */
+SIMSTATE unsigned long evtimerops = 0;  /* of those, timers started, stopped or gone off */
+SIMSTATE unsigned long evheapops = 0;   /* inserts and removes that reached the heap */
+SIMSTATE struct event *wheel[2][WHEEL_SLOTS]; /* level 0: a tick a slot, level 1: WHEEL_SLOTS ticks */
+SIMSTATE int wheeln[2];                 /* timers on each level */
+SIMSTATE long wheeltick = 0;            /* the timers of earlier ticks are on the heap */
+
+/* the medium towards each entity is a FIFO queue: packets leave it in the */
+/* order they went in, so only the newest packet's arrival time matters.  */
+/* With -reorder a few packets are held back outside that order instead.  */
+#define  REORDER_HELD    16    /* packets held back at once, per direction */
+struct channel {
+   simclock tail;          /* arrival time of the newest packet in flight */
+   int inflight;           /* packets in flight, not yet delivered */
+   simclock busy;          /* LINK_QUEUE: when the last packet is serialized */
+   int bad;                /* Gilbert-Elliott state: 1 in the lossy state */
+   int nheld;              /* packets held back by -reorder */
+   struct event *held[REORDER_HELD];
+   int heldleft[REORDER_HELD];  /* later packets still to overtake each */
+};
+
+/* link models, chosen with -link, and their parameters for each direction */
+/* (indexed by the receiving entity; the links towards the other even     */
+/* entities are like the one towards A, towards the odd ones like B's).   */
+/* Options set both directions; with an _ab or _ba suffix                 */
+/* (-bandwidth_ab 100) they set only the one from A to B or from B to A.  */
+#define  LINK_UNIFORM    0     /* 1 to 10 time units after the packet ahead */
+#define  LINK_QUEUE      1     /* router queue, bottleneck, propagation delay */
+char *linkname[] = { "uniform", "queue", NULL };
+
+struct link {
+   int model;              /* LINK_... */
+   float bandwidth;        /* bytes per time unit out of the queue, 0: no limit */
+   float delay;            /* propagation delay after the queue */
+   int queuemax;           /* packets the queue holds, more are dropped; 0: no limit */
+   float loss;             /* loss probability, < 0: lossprob */
+   float gebad;            /* Gilbert-Elliott: P(good -> bad) per packet, 0: off */
+   float gegood;           /* P(bad -> good) per packet */
+   float badloss;          /* loss probability in the bad state */
+   float reorder;          /* probability that a packet is held back, 0: FIFO */
+   int reorderdepth;       /* held back behind 1 to this many later packets */
+   float duplicate;        /* probability that a packet arrives twice */
+};
+SIMSTATE struct link linkcfg[2] = {
+   { LINK_UNIFORM, 0.0, 0.0, 0, -1.0, 0.0, 0.0, 1.0, 0.0, 3, 0.0 },
+   { LINK_UNIFORM, 0.0, 0.0, 0, -1.0, 0.0, 0.0, 1.0, 0.0, 3, 0.0 },
+};
+SIMSTATE int duplicating = 0;           /* tolayer3() is sending the copy */
+
+/* events come from a free-list pool that is refilled a chunk at a time, */
+/* instead of one malloc/free per event                                 */
+#define  EVPOOL_CHUNK    256
+SIMSTATE struct event *evfree = NULL;   /* pool of free events */
+SIMSTATE long evallocs = 0;             /* events handed out by newevent() */
+SIMSTATE long evchunks = 0;             /* chunks malloc'd for the pool */
+SIMSTATE int evinuse = 0;               /* events handed out and not yet freed */
+SIMSTATE int evpeak = 0;                /* most events ever in use at once */
+
+/* packet payloads live in reference-counted buffers, so that a packet  */
+/* goes from the sender's buffer through tolayer3(), the event queue and */
+/* ep_input() as a pointer, without its bytes being copied.            */
+/* Whoever keeps a payload beyond the call that gave it to them takes a */
+/* reference (pktbuf_hold) and drops it when done (pktbuf_release).     */
+#define  PKTBUF_CHUNK    256
+struct pktbuf {
+   int refs;               /* references held, 0: in the pool */
+   struct pktbuf *next;    /* links free buffers in the pool */
+   char data[MSS_MAX];
+};
+struct pbchunk {
+   struct pbchunk *next;   /* all chunks, so siminit() can refill the pool */
+   struct pktbuf buf[PKTBUF_CHUNK];
+};
+SIMSTATE struct pktbuf *pbfree = NULL;  /* pool of free payload buffers */
+SIMSTATE struct pbchunk *pbchunklist = NULL;
+SIMSTATE long pballocs = 0;             /* buffers handed out by pktbuf_alloc() */
+SIMSTATE long pbchunks = 0;             /* chunks malloc'd for the pool */
+SIMSTATE int pbinuse = 0;               /* buffers with references */
+SIMSTATE int pbpeak = 0;                /* most buffers ever in use at once */
+
+/* binary event trace (-tracefile FILE): fixed-width records collected in */
+/* a large buffer and written out a whole buffer at a time.  trace_decode */
+/* turns a trace file back into text or CSV.  The file starts with a      */
+/* struct traceheader and the two entities of each connection (int32_t),  */
+/* followed by struct tracerec records.  A record names the endpoint, the */
+/* decoder finds its entity and peer in that table.                       */
+#define  TRACE_MAGIC     "RTPTRACE"
+#define  TRACE_VERSION   4
+#define  TRACE_BUFRECS   65536  /* records buffered before a write */
+
+struct traceheader {
+   char magic[8];          /* TRACE_MAGIC */
+   uint32_t byteorder;     /* 0x01020304 as written by this machine */
+   uint32_t version;       /* TRACE_VERSION */
+   uint32_t recsize;       /* sizeof(struct tracerec) */
+   uint32_t connections;   /* connections in the run */
+};
+
+struct tracerec {           /* 24 bytes */
+   double time;            /* simulation time of the record */
+   int32_t seq;            /* packet seqnum, or message number for TR_LAYER5 */
+   int32_t ack;            /* packet acknum */
+   int32_t endpoint;       /* 2*connection, + 1 for the second end */
+   uint16_t checksum;      /* packet checksum, 16 bits as on the wire */
+   uint8_t type;           /* TR_... */
+   uint8_t flags;          /* TRF_..., and the TRO_... outcome of a TR_SEND */
+};
+
+/* record types */
+#define  TR_LAYER5       0     /* message from layer 5 given to entity */
+#define  TR_SEND         1     /* entity passed a packet to tolayer3 */
+#define  TR_ARRIVE       2     /* packet arrived at entity from layer 3 */
+#define  TR_TIMEOUT      3     /* timer of entity went off */
+#define  TR_TIMERSTART   4
+#define  TR_TIMERSTOP    5
+#define  TR_DELIVER      6     /* entity passed a message to tolayer5 */
+
+/* record flags */
+#define  TRF_ACK         1     /* isACK set */
+#define  TRF_NAK         2     /* ACK with acknum -1 */
+#define  TRF_OUTCOME     4     /* the outcome is flags >> TRF_OUTCOME */
+
+/* TR_SEND outcomes */
+#define  TRO_OK          0
+#define  TRO_LOST        1
+#define  TRO_CORRUPT     2
+#define  TRO_QUEUEDROP   3
+
+SIMSTATE FILE *tracefp = NULL;          /* binary trace file, NULL: off */
+SIMSTATE struct tracerec *tracebuf = NULL;
+SIMSTATE int tracenrec = 0;             /* records waiting in tracebuf */
+SIMSTATE long tracewritten = 0;         /* records written since traceopen() */
+
+/* end-of-run statistics.  The protocol code counts what only it knows   */
+/* (retransmissions, NAKs, messages it refused); the emulator matches    */
+/* each delivery to layer 5 with the oldest undelivered message from the */
+/* other side, which gives the per-message latency and the duplicates.   */
+struct stats {
+   int delivered;          /* messages delivered to layer 5 in order */
+   long deliveredbytes;    /* bytes of those messages */
+   long wirebytes;         /* bytes of the frames sent into layer 3 */
+   long hdrbytes;          /* the header bytes among them */
+   int malformed;          /* corrupted frames the receiver couldn't parse or demultiplex (also in ncorrupt) */
+   long copies;            /* payload copies made with pktcopy() */
+   long copybytes;         /* bytes of those copies */
+   int duplicates;         /* deliveries that were not the next message */
+   int retransmits;        /* data packets sent again (protocol) */
+   long retransbytes;      /* bytes of those packets (protocol) */
+   int naks;               /* NAKs sent (protocol) */
+   int bufferdrops;        /* layer 5 messages refused by a full sender (protocol) */
+   int bufferhigh;         /* most packets a sender buffer held at once (protocol) */
+   int buffergrows;        /* times a full sender buffer was grown (protocol) */
+   int blocks;             /* times a full sender made layer 5 wait */
+   int heldmax;            /* most messages layer 5 held for one endpoint at once */
+   int queuedrops;         /* packets a full router queue dropped (also in nlost) */
+   int badlost;            /* packets lost in the Gilbert-Elliott bad state (also in nlost) */
+   int reordered;          /* packets the medium held back behind later ones */
+   int duplicated;         /* extra copies the medium delivered */
+   double heldwait;        /* total time messages waited in layer 5 */
+   int timeouts;           /* timer interrupts */
+   int spurious;           /* timeouts an ACK showed to be needless (protocol) */
+   int fastretx;           /* retransmits on duplicate ACKs, not timeouts (protocol) */
+   double idle;            /* time from an entity's last packet to its timeouts */
+   long clockties;         /* events at the same time as the one before */
+};
+SIMSTATE struct stats stats;
+
+/* a message from layer 5 that has not been delivered yet.  Those from   */
+/* pendgive on are still held in layer 5 because the sender blocked it. */
+struct pending {
+   simclock time;          /* arrival from layer 5 */
+   int length;             /* bytes of data */
+   char data;              /* the letter its data is filled with */
 };
-struct event *evlist = NULL;   /* the event list */
+
+/* the entities of the network, A (0), B (1) and with -endpoints N more */
+struct host {
+   struct channel chan;    /* the medium towards it */
+   simclock lastactivity;  /* last time it sent or received a packet */
+};
+SIMSTATE struct host *host;             /* indexed by entity */
+SIMSTATE int hostmax = 0;               /* entries allocated in host */
+
+/* the flow table.  Connection c joins entities flowtab[c].end[0] and  */
+/* end[1], the protocol has an endpoint at each end, 2c and 2c+1, and  */
+/* its packets carry c in their header.  Connections are numbered      */
+/* densely, so the endpoint of an arriving packet is one lookup in the */
+/* table (flowlookup) however many there are.  All the connections     */
+/* towards an entity share the medium towards it.  The traffic matrix  */
+/* (-traffic) and -flows say which there are; see trafficinit().       */
+struct flow {
+   int end[2];             /* the entities it joins */
+};
+struct port {              /* what the emulator keeps for each endpoint */
+   double rate;            /* its share of the layer 5 messages, 0: none */
+   struct event *timer;    /* its pending timer, NULL if none */
+   struct pending *pending; /* messages it was given, in order */
+   int pendhead, pendtail; /* oldest undelivered, next free */
+   int pendgive;           /* oldest not given to the sender yet */
+   int pendmax;            /* slots allocated in pending */
+   int blocked;            /* the sender can't take messages now */
+   int delivered;          /* its messages delivered at the other end */
+   long deliveredbytes;    /* bytes of those messages */
+};
+SIMSTATE struct flow *flowtab;          /* indexed by connection */
+SIMSTATE struct port *port;             /* indexed by endpoint */
+SIMSTATE int nflow;                     /* connections in this run */
+SIMSTATE int flowmax = 0;               /* entries allocated in flowtab, twice that in port */
+SIMSTATE int connbytes = 0;             /* CONN_BYTES of this run */
+SIMSTATE int *sources;                  /* the endpoints that send, ... */
+SIMSTATE double *ratesum;               /* ... and the sum of their rates so far */
+SIMSTATE int nsources;
+SIMSTATE char *msgbuf;                  /* data of the message given to a sender */
+SIMSTATE float *latency;                /* end-to-end latency of each delivery */
+char *statsjson = NULL;                 /* -json FILE, "-": stdout */
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0
@@ -37,33 +335,108 @@ struct event *evlist = NULL;   /* the event list */
 #define  A      0
 #define  B      1
 
-int TRACE = 1;             /* for my debugging */
-int nsim = 0;              /* number of messages from 5 to 4 so far */
-int nsimmax = 0;           /* number of msgs to generate, then stop */
-float time = 0.000;
-float lossprob;            /* probability that a packet is dropped  */
-float corruptprob;         /* probability that one bit is packet is flipped */
-float lambda;              /* arrival rate of messages from layer 5 */
-int   ntolayer3;           /* number sent into layer 3 */
-int   nlost;               /* number lost in media */
-int   ncorrupt;            /* number corrupted by media*/
-
-/* a packet is the data unit passed from layer 4 (students code) to layer */
-/* 3 (teachers code).  Note the pre-defined packet structure, which all   */
-/* students must follow. */
-struct pkt {
-   int seqnum;
-   int acknum;
-   int checksum;
-   int isACK;
-   char payload[20];
+SIMSTATE int TRACE = 1;                 /* for my debugging */
+
+/* trace output: TRACE picks the level at run time and TRACE_LEVEL is the */
+/* most detailed level compiled in.  Build with -DTRACE_LEVEL=0 for the   */
+/* quiet, fast binary: every per-event printf is compiled out.            */
+/*   1: protocol events, lost and corrupted packets                       */
+/*   2: the event list, buffer and ACK counters                           */
+/*   3: emulator internals                                                */
+#ifndef TRACE_LEVEL
+#define  TRACE_LEVEL     3
+#endif
+#define  TRACING(level)  ((level) <= TRACE_LEVEL && (level) <= TRACE)
+#define  tracef(level, ...) \
+   do { if (TRACING(level)) printf(__VA_ARGS__); } while (0)
+SIMSTATE int nsim = 0;                  /* number of messages from 5 to 4 so far */
+SIMSTATE int nsimmax = 0;               /* number of msgs to generate, then stop */
+SIMSTATE simclock simtime = 0.000;      /* simulation clock */
+SIMSTATE float lossprob;                /* probability that a packet is dropped  */
+SIMSTATE float corruptprob;             /* probability that one bit is packet is flipped */
+SIMSTATE float lambda;                  /* arrival rate of messages from layer 5 */
+SIMSTATE int   ntolayer3;               /* number sent into layer 3 */
+SIMSTATE int   nlost;                   /* number lost in media */
+SIMSTATE int   ncorrupt;                /* number corrupted by media*/
+
+/* random number streams: each source of randomness has its own xoshiro256** */
+/* stream, so that changing how often one is used leaves the others alone;   */
+/* the link sources have one per direction (+ the receiving entity & 1)      */
+#define  RNG_MISC        0     /* jimsrand(), benchmarks */
+#define  RNG_ARRIVAL     1     /* time between layer 5 messages */
+#define  RNG_ENTITY      2     /* which entity a message arrives at */
+#define  RNG_LOSS        3     /* + entity: random loss */
+#define  RNG_BURST       5     /* + entity: Gilbert-Elliott state changes */
+#define  RNG_CORRUPT     7     /* + entity: corruption and what it hits */
+#define  RNG_DELAY       9     /* + entity: transit time (LINK_UNIFORM) */
+#define  RNG_REORDER     11    /* + entity: holding packets back */
+#define  RNG_DUPLICATE   13    /* + entity: duplicates */
+#define  RNG_LENGTH      15    /* message lengths */
+#define  RNG_STREAMS     16
+SIMSTATE uint64_t rngstate[RNG_STREAMS][4];
+
+/* run parameters, settable with command-line options or a config file */
+/* protocols, chosen with -protocol; each program implements some of them */
+#define  PROTO_SW        0     /* stop-and-wait (project2_stop_wait) */
+#define  PROTO_GBN       1     /* go-back-N (project2_gbn) */
+#define  PROTO_SR        2     /* selective repeat (project2_gbn) */
+char *protoname[] = { "sw", "gbn", "sr", NULL };
+/* congestion control, chosen with -cc (go-back-N and selective repeat) */
+#define  CC_FIXED        0     /* always WINDOW_SIZE packets in flight */
+#define  CC_RENO         1     /* slow start, AIMD, fast retransmit */
+char *ccname[] = { "fixed", "reno", NULL };
+
+SIMSTATE int   BIDIRECTIONAL = 1;       /* layer 5 messages arrive at both A and B */
+SIMSTATE int   NENTITY = 2;             /* entities in the network (-endpoints) */
+SIMSTATE int   FLOWS = 1;               /* connections per traffic matrix entry (-flows) */
+SIMSTATE float TIME_OUT = 24.0;         /* retransmission timeout used by the protocol */
+SIMSTATE int   WINDOW_SIZE = 8;         /* sender window (go-back-N) */
+SIMSTATE int   BUFFER_SIZE = 50;        /* sender buffer slots (go-back-N) */
+SIMSTATE int   BUFFER_MAX = 0;          /* a full buffer may grow up to this (go-back-N) */
+SIMSTATE int   BACKPRESSURE = 0;        /* a full sender blocks layer 5 instead of dropping */
+SIMSTATE int   ADAPTIVE_RTO = 0;        /* timeout from RTT estimates instead of TIME_OUT */
+SIMSTATE int   CONGESTION = CC_FIXED;   /* congestion control algorithm */
+SIMSTATE int   MSS = 20;                /* most payload bytes per segment */
+SIMSTATE int   MSGLEN = 20;             /* bytes per message from layer 5 */
+SIMSTATE int   MSGLENMAX = 0;           /* > MSGLEN: lengths uniform in MSGLEN..MSGLENMAX */
+SIMSTATE int   SEQBITS = 16;            /* bits of seqnum and acknum on the wire */
+SIMSTATE unsigned int seed = 9999;      /* random number generator seed */
+char *tracefile = NULL;                 /* -tracefile, NULL: no binary trace */
+SIMSTATE char *traffic = NULL;          /* -traffic: pairs (NULL), ring or a FILE */
+
+/* parameter sweeps (-sweep FILE), shared by all worker threads */
+#define  MAXSWEEP        16    /* parameters swept at once */
+#define  MAXVALUES       64    /* values per swept parameter */
+char *sweepfile = NULL;        /* file listing the swept parameters */
+int nthreads = 0;              /* worker threads, 0: one per CPU */
+SIMSTATE jmp_buf *simescape = NULL;     /* where simabort() goes in a sweep */
+SIMSTATE long simrun = -1;              /* the sweep run this thread is on, -1: none */
+
+/* the run parameters setparam() sets, all together: a sweep takes them  */
+/* from the command line once and starts every run from a copy.  A new   */
+/* parameter goes here and in paramsave() and paramload() too.           */
+struct params {
+   int nsimmax;
+   float lossprob, corruptprob, lambda;
+   int TRACE;
+   float TIME_OUT;
+   int WINDOW_SIZE, BUFFER_SIZE, BUFFER_MAX, BACKPRESSURE;
+   unsigned int seed;
+   int BIDIRECTIONAL, NENTITY, FLOWS;
+   char *traffic;
+   int PROTOCOL, SACK, ADAPTIVE_RTO, CONGESTION;
+   int MSS, MSGLEN, MSGLENMAX, SEQBITS;
+   struct link linkcfg[2];
 };
+struct params options;         /* the command-line options of a sweep, read-only in the workers */
 
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
-/* to layer 5 via the students transport level protocol entities.         */
+/* to layer 5 via the students transport level protocol entities.  The    */
+/* data belongs to the caller and is only valid during the call.          */
 struct msg {
-  char data[20];
+  int length;             /* bytes of data, any number */
+  char *data;
 };
 
 // Project variables
@@ -74,363 +447,522 @@ struct msg {
 #define YEL   "\x1B[33m"
 #define RESET "\x1B[0m"
 
-float   time_ret_pkt_sentA;
-float   time_ret_pkt_sentB;
-int ret_A;
-int ret_B;
-int total_received_ACKs;
-struct pkt last_accepted_packet_A;
-struct pkt last_accepted_packet_B;
-struct pkt last_sent_from_A;
-struct pkt last_sent_from_B;
-
-void init();
+// Retransmission timeout.  With -rto adaptive each sender estimates the round
+// trip time from ACKs of packets that were never resent (Karn) and sets its
+// timeout to SRTT + 4*RTTVAR, doubling it when a packet times out again until
+// an ACK for new data arrives.  With -rto fixed (the default) the timeout stays TIME_OUT.
+#define RTO_MIN 2.0           // No round trip is shorter: 1 time unit each way
+#define RTO_MAX 1000.0
+#define RESENT_NAK 1          // Why a packet was last sent again
+#define RESENT_TIMEOUT 2
+
+struct rtt {
+  float srtt;                 // Smoothed round trip time, 0 before the first sample
+  float rttvar;               // Its mean deviation
+  float minrtt;               // Shortest sample so far
+  int backoff;                // Timeouts since an ACK last acknowledged new data
+  float rto;                  // Timeout to use now
+  double timeout_at;          // Last timeout, until an ACK shows whether it was spurious
+};
+
+SIMSTATE int PROTOCOL = PROTO_SW;              // Only stop-and-wait is implemented here
+SIMSTATE int SACK = 0;                         // Unused: there is only ever one packet to ACK
+
+SIMSTATE int total_received_ACKs;
+
+void init(int argc, char **argv);
+void siminit();
+void simulate();
+void simabort(char *fmt, ...);
+void paramsave(struct params *p);
+void paramload(struct params *p);
+int sweep();
+void linkcsv(char *buf, int size);
+void traceopen(char *file);
+void tracerecord(int type, int e, struct pkt *packet, int arg);
+void traceclose();
 void generate_next_arrival();
+char *entname(int e);
+char *epname(int e);
 void tolayer5(int AorB, struct msg message);
+void blocklayer5(int AorB);
+void unblocklayer5(int AorB);
+void feedlayer5(int AorB);
 void tolayer3(int AorB, struct pkt packet);
+int pkt_serialize(struct pkt *packet, unsigned char *hdr);
+int pkt_parse(unsigned char *hdr, int len, char *payload, struct pkt *packet);
+void putfield(unsigned char *p, unsigned v, int n);
+unsigned getfield(unsigned char *p, int n);
+char *pktbuf_alloc();
+void pktbuf_hold(char *payload);
+void pktbuf_release(char *payload);
+void pktcopy(char *to, const char *from, int n);
+void pktbuf_reset();
 void starttimer(int AorB, float increment);
 void stoptimer(int AorB);
+int timerrunning(int AorB);
+struct event *newevent();
+void freeevent(struct event *p);
 void insertevent(struct event *p);
-void init();
+void evheapinsert(struct event *p);
+struct event *nextevent();
+void removeevent(struct event *p);
+int wheelinsert(struct event *p);
+void wheelunlink(struct event *p);
+void wheeldue();
+void evqbench();
+void cksumbench();
+void entitybench();
+void backlogbench();
+int clockbench();
+void flowbench();
+void tracebench();
+void trafficinit();
+int flowlookup(int c, int to, int from);
+void initendpoints();
+struct pending *pendnew(struct port *h);
 float jimsrand();
+void rnginit(uint64_t seed);
+double rnd(int stream);
 void printevlist();
+void latencystats(float *p50, float *p99, float *max);
+double fairness(double *min, double *mean, double *max);
+void statsreport(FILE *fp, int json);
+
+
+
+
+/********* STUDENTS WRITE THE NEXT FOUR ROUTINES *********/
+/* ep_init(), ep_output(), ep_input() and ep_timerinterrupt() are called */
+/* with the id of the endpoint, an index into ep[].                       */
+
+/* The protocol state of one end of a connection, see ep_init(). */
+struct endpoint {
+	int id, conn;
+	int seq_expect_send;	/* Next sequence number to send*/
+	int seq_expect_recv;	/* Next sequence number to receive */
+	int is_waiting;		/* Whether the endpoint is waiting */
+	double time_ret_pkt_sent;	/* Used to output time of retransmission on success ACKs */
+	int ret;		/* Whether the waiting packet was retransmitted */
+	struct pkt last_accepted_packet;	/* The last packet accepted here */
+	struct pkt last_sent_from;	/* The last packet sent from here */
+	struct pkt waiting_packet;	/* Packet held until it is ACKed */
+	double sent_time;	/* When the waiting packet was first sent */
+	int resent;		/* 0, RESENT_NAK or RESENT_TIMEOUT */
+	struct rtt rtt;		/* Round trip estimate and timeout */
+	char **segbuf;		/* The message being sent, a buffer per segment */
+	int nseg;		/* Segments in segbuf */
+	int segcap;		/* Room in segbuf */
+	int sendlen;		/* Its bytes */
+	int sendoff;		/* Where the segment in flight starts */
+	char *reasm;		/* Message being reassembled here */
+	int reasmlen;		/* Its bytes so far */
+	int reasmcap;		/* Room in reasm */
+};
 
-
-
-
-/********* STUDENTS WRITE THE NEXT SEVEN ROUTINES *********/
-#define TIME_OUT 24.0
-#define DEBUG 1
-
-int seq_expect_send_A;	/* Next sequence number to send*/
-int seq_expect_recv_A;	/* Next sequence number to receive */
-int is_waiting_A;			/* Whether side A is waiting */
-int seq_expect_send_B;	/* Next sequence number to send*/
-int seq_expect_recv_B;	/* Next sequence number to receive */
-int is_waiting_B;			/* Whether side B is waiting */
-
-struct pkt waiting_packet_A;	/* Packet hold in A */
-struct pkt waiting_packet_B;	/* Packet hold in A */
+SIMSTATE struct endpoint *ep;	/* Indexed by endpoint, see ep_init() */
+SIMSTATE int nep;		/* Entries allocated */
 
 /* Print payload */
-void print_pkt(char *action, struct pkt packet)
+void print_pkt(char *action, int id, struct pkt packet)
 {
-	printf("%s: ", action);
+	printf("%s %s: ", action, epname(id));
 	printf("seq = %d, ack = %d, isACK = %d, checksum = %x, ", packet.seqnum, packet.acknum, packet.isACK, packet.checksum);
-	int i;
-	for (i = 0; i < 20; i++)
-		putchar(packet.payload[i]);
-	putchar('\n');
+	printf("%.*s\n", packet.length, packet.length ? packet.payload : "");
 }
 
-/* Compute checksum */
-int compute_check_sum(struct pkt packet)
+/* Segments of at most MSS bytes a message of length bytes is sent in */
+int segments(int length)
 {
-	int sum = 0, i = 0;
-	sum = packet.checksum;
-	sum += packet.seqnum;
-	sum += packet.acknum;
-    sum += packet.isACK;
+	return length <= MSS ? 1 : (length + MSS - 1) / MSS;
+}
 
-	sum = (sum >> 16) + (sum & 0xffff);
-	for (i = 0; i < 20; i += 2) {
-		sum += (packet.payload[i] << 8) + packet.payload[i+1];
-		sum = (sum >> 16) + (sum & 0xffff);
+/* Fold a one's complement sum to 16 bits, adding the carries back in */
+unsigned cksum_fold(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* One's complement sum of len bytes read as big-endian 16-bit words (an odd
+   last byte is padded with a zero), folded to 16 bits.  The bytes are added
+   8 at a time in the machine's byte order, which only rotates the folded sum
+   by a byte on a little-endian machine (RFC 1071), so it is swapped back. */
+unsigned cksum_add(const void *buf, int len)
+{
+	static const uint16_t one = 1;
+	const unsigned char *p = buf;
+	unsigned char last[2] = { 0, 0 };
+	uint64_t sum = 0, w8;
+	uint32_t w4;
+	uint16_t w2;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w8, p, 8);
+		sum += w8;
+		sum += sum < w8;		/* end-around carry */
 	}
-	sum = (~sum) & 0xffff;
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	if (len >= 4) {
+		memcpy(&w4, p, 4);
+		sum += w4;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w2, p, 2);
+		sum += w2;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		last[0] = *p;
+		memcpy(&w2, last, 2);
+		sum += w2;
+	}
+	sum = cksum_fold(sum);
+	if (*(const unsigned char *)&one)
+		sum = ((sum >> 8) | (sum << 8)) & 0xffff;
 	return sum;
 }
 
-/* called from layer 5, passed the data to be sent to other side */
-void A_output(struct msg message)
+/* Compute checksum: the Internet checksum of the header fields, each as two
+   16-bit words, and of the payload bytes used, which are unsigned */
+int compute_check_sum(const struct pkt *packet)
 {
-	/* If A is waiting for a packet to arrive to B, ignore the message */
-	if (is_waiting_A) {
-    printf(YEL);
-    printf("Currently waiting for ACK from packet sent to B. Ignore\n");
-    printf(RESET);
-    return;
-  }
+	uint64_t sum;
+
+	sum = (uint32_t)packet->checksum;
+	sum += (uint32_t)packet->seqnum;
+	sum += (uint32_t)packet->acknum;
+	sum += (uint32_t)packet->isACK;
+	sum += (uint32_t)packet->length;
+	sum += (uint32_t)packet->more;
+	sum += (uint32_t)packet->conn;
+	if (packet->length > 0 && packet->length <= MSS_MAX)
+		sum += cksum_add(packet->payload, packet->length);
+	return ~cksum_fold(sum) & 0xffff;
+}
 
-	/* Send packet to B side */
-	memcpy(waiting_packet_A.payload, message.data, sizeof(message.data));
-	waiting_packet_A.seqnum = seq_expect_send_A;
-    waiting_packet_A.isACK = 0;
-	waiting_packet_A.checksum = 0;
-	waiting_packet_A.checksum = compute_check_sum(waiting_packet_A);
-  last_sent_from_A = waiting_packet_A;
-	tolayer3(0, waiting_packet_A);
-	starttimer(0, TIME_OUT);
-	is_waiting_A = 1;
-	/* Debug output */
-	if (DEBUG)
-		print_pkt("Sent from A", waiting_packet_A);
+/* The checksum after a header field changes from old to new, without summing
+   the rest of the packet again: HC' = ~(~HC + ~m + m') (RFC 1624) */
+int cksum_update(int checksum, int old, int new)
+{
+	uint64_t sum;
+
+	sum = ~checksum & 0xffff;
+	sum += (uint32_t)~old;
+	sum += (uint32_t)new;
+	return ~cksum_fold(sum) & 0xffff;
 }
 
-void B_output(struct msg message)
+SIMSTATE int ack_checksum;	/* Checksum of an ACK for 0, no payload */
+
+/* ACKs and NAKs (acknum -1) differ only in acknum and connection, so each
+   starts as the ACK for 0 on connection 0 with its checksum patched for both */
+struct pkt make_ack(int conn, int acknum)
 {
-	/* If B is waiting, ignore the message */
-  if (is_waiting_B) {
-    printf(YEL);
-    printf("Currently waiting for ACK from packet sent to A. Ignore\n");
-    printf(RESET);
-    return;
-  }
-	/* Send packet to A side */
-	memcpy(waiting_packet_B.payload, message.data, sizeof(message.data));
-	waiting_packet_B.seqnum = seq_expect_send_B;
-    waiting_packet_B.isACK = 0;
-	waiting_packet_B.checksum = 0;
-	waiting_packet_B.checksum = compute_check_sum(waiting_packet_B);
-  last_sent_from_B = waiting_packet_B;
-	tolayer3(1, waiting_packet_B);
-	starttimer(1, TIME_OUT);
-	is_waiting_B = 1;
-	/* Debug output */
-	if (DEBUG)
-		print_pkt("Sent from B", waiting_packet_B);
+	struct pkt ackpkt;
+
+	ackpkt.seqnum = 0;
+	ackpkt.acknum = 0;
+	ackpkt.checksum = 0;
+	ackpkt.isACK = 1;
+	ackpkt.length = 0;
+	ackpkt.more = 0;
+	ackpkt.conn = 0;
+	ackpkt.payload = NULL;
+	if (!ack_checksum)
+		ack_checksum = compute_check_sum(&ackpkt);
+	ackpkt.acknum = acknum;
+	ackpkt.conn = conn;
+	ackpkt.checksum = cksum_update(cksum_update(ack_checksum, 0, acknum), 0, conn);
+	return ackpkt;
 }
 
+void rtt_init(struct rtt *r)
+{
+  r->srtt = r->rttvar = r->minrtt = 0;
+  r->backoff = 0;
+  r->rto = TIME_OUT;
+  r->timeout_at = -1;
+}
 
-/* called from layer 3, when a packet arrives for layer 4 */
-void A_input(struct pkt packet)
+/* SRTT + 4*RTTVAR (TIME_OUT before the first sample), doubled per backoff */
+void rtt_setrto(struct rtt *r)
 {
-    if (DEBUG)
-		print_pkt("Received at A", packet);
+  float rto = r->srtt == 0 ? TIME_OUT : r->srtt + 4 * r->rttvar;
 
-    int ans_checksum = packet.checksum;
-    packet.checksum = 0;
-    if (compute_check_sum(packet) != ans_checksum) {
-          printf(RED);
-          print_pkt("Checksum error at A", packet);
-          printf(RESET);
-          struct pkt nakpkt;
-          nakpkt.acknum = -1;
-          nakpkt.isACK = 1;
-          nakpkt.checksum = 0;
-          nakpkt.checksum = compute_check_sum(nakpkt);
-          printf(YEL);
-          printf("Sent NAK from A\n");
-          printf(RESET);
-          //last_sent_from_A = nakpkt;
-          tolayer3(0, nakpkt);
-      return;
-    }
-    packet.checksum = ans_checksum;
+  if (rto < RTO_MIN)
+    rto = RTO_MIN;
+  for (int i = 0; i < r->backoff && rto < RTO_MAX; i++)
+    rto *= 2;
+  r->rto = rto < RTO_MAX ? rto : RTO_MAX;
+}
 
-    if(packet.isACK == 1) {
-      if (packet.acknum > -1 && is_waiting_A == 1)
-	       stoptimer(0);
-        if (packet.acknum == seq_expect_send_A) {	/* ACK */
-            if (ret_A == 1) {
-              printf(GRN);
-              printf("A just received ACK from B for a packet originally retransmitted at time %f\n", time_ret_pkt_sentA);
-              printf(RESET);
-              ret_A = 0;
-            }
-            total_received_ACKs++;
-            printf(GRN);
-            printf("Total successful ACKs: %d\n", total_received_ACKs);
-            printf(RESET);
-            seq_expect_send_A = 1 - seq_expect_send_A;
-            is_waiting_A = 0;
-        } else if (packet.acknum == -1) {		/* NAK */
-            // printf(YEL);
-            // printf("Received NAK\n");
-            // printf("Retransmitting from A\n");
-            // printf(RESET);
-            // last_sent_from_A = waiting_packet_A;
-            // tolayer3(0, waiting_packet_A);
-            // stoptimer(0);
-            // starttimer(0, TIME_OUT);
-            printf(YEL);
-            printf("Received NAK\n");
-            printf("Retransmitting last sent packet from A\n");
-            printf(RESET);
-            tolayer3(0, last_sent_from_A);
-        }
-    }else if (packet.seqnum == seq_expect_recv_A) {
-  		/* Pass data to layer5 */
-  		struct msg message;
-  		memcpy(message.data, packet.payload, sizeof(packet.payload));
-  		tolayer5(0, message);
-  		seq_expect_recv_A = 1 - seq_expect_recv_A;
-  		/* Debug output */
-  		if (DEBUG)
-  			print_pkt("Accpeted at A", packet);
-      last_accepted_packet_A = packet;
-      /* Send ACK to B side */
-      struct pkt ackpkt;
-      ackpkt.isACK = 1;
-      ackpkt.acknum = packet.seqnum;
-      ackpkt.checksum = 0;
-      ackpkt.checksum = compute_check_sum(ackpkt);
-      last_sent_from_A = ackpkt;
-      tolayer3(0, ackpkt);
-    } else if (packet.seqnum != seq_expect_recv_A) {
-      printf(YEL);
-      printf("Received unexpected seqnum.\n");
-      printf("Previous ACK probably didn't arrive.\n");
-      printf("Resent ACK to A.\n");
-      printf(RESET);
-      struct pkt ackpkt;
-      ackpkt.isACK = 1;
-      ackpkt.acknum = last_accepted_packet_A.seqnum;
-      ackpkt.checksum = 0;
-      ackpkt.checksum = compute_check_sum(ackpkt);
-      last_sent_from_A = ackpkt;
-      tolayer3(0, ackpkt);
-    } else {
-      exit(1);
-    }
+void rtt_sample(struct rtt *r, float sample)
+{
+  if (r->minrtt == 0 || sample < r->minrtt)
+    r->minrtt = sample;
+  if (r->srtt == 0) {
+    r->srtt = sample;
+    r->rttvar = sample / 2;
+  } else {
+    r->rttvar = 0.75 * r->rttvar + 0.25 * (r->srtt > sample ? r->srtt - sample : sample - r->srtt);
+    r->srtt = 0.875 * r->srtt + 0.125 * sample;
+  }
+}
+
+/* The sender's timer went off; again: for a packet a timeout already resent. */
+/* Only repeated timeouts back off, so that the per-packet timers of         */
+/* selective repeat don't compound each other's backoff.                     */
+void rtt_timeout(struct rtt *r, int again)
+{
+  r->timeout_at = simtime;
+  if (ADAPTIVE_RTO && again) {
+    r->backoff++;
+    rtt_setrto(r);
+  }
 }
 
-/* called when A's timer goes off */
-void A_timerinterrupt()
+/* An ACK arrived for new data, the newest packet it covers first sent at  */
+/* time sent.  If that packet was never resent it gives an RTT sample.  If */
+/* the last timeout resent it and the ACK is back sooner than any round    */
+/* trip seen so far, it must be the ACK of the first copy: that timeout    */
+/* was spurious.  Either way the link works again, so the backoff ends.    */
+void rtt_ack(struct rtt *r, double sent, int resent)
 {
-  printf(YEL);
-  printf("Retransmitted from A\n");
-  printf(RESET);
-  last_sent_from_A = waiting_packet_A;
-	tolayer3(0, waiting_packet_A);
-  if (ret_A == 0) {
-    time_ret_pkt_sentA = time;
-    ret_A = 1;
+  if (resent == 0)
+    rtt_sample(r, simtime - sent);
+  else if (resent == RESENT_TIMEOUT && r->timeout_at >= 0) {
+    if (r->minrtt > 0 && simtime - r->timeout_at < r->minrtt)
+      stats.spurious++;
+    r->timeout_at = -1;
   }
-	starttimer(0, TIME_OUT);
+  r->backoff = 0;
+  if (ADAPTIVE_RTO)
+    rtt_setrto(r);
+}
+
+/* Send the segment of the message that starts at sendoff to the other end */
+void send_segment(struct endpoint *e)
+{
+	int n = e->sendlen - e->sendoff < MSS ? e->sendlen - e->sendoff : MSS;
+
+	e->waiting_packet.payload = e->segbuf[e->sendoff / MSS];
+	e->waiting_packet.length = n;
+	e->waiting_packet.more = e->sendoff + n < e->sendlen;
+	e->waiting_packet.seqnum = e->seq_expect_send;
+    e->waiting_packet.isACK = 0;
+	e->waiting_packet.checksum = 0;
+	e->waiting_packet.checksum = compute_check_sum(&e->waiting_packet);
+  e->last_sent_from = e->waiting_packet;
+	tolayer3(e->id, e->waiting_packet);
+	e->sent_time = simtime;
+	e->resent = 0;
+	starttimer(e->id, e->rtt.rto);
+	e->is_waiting = 1;
+	/* Debug output */
+	if (TRACING(1))
+		print_pkt("Sent from", e->id, e->waiting_packet);
 }
 
-/* the following routine will be called once (only) before any other */
-/* entity A routines are called. You can use it to do any initialization */
-void A_init()
+/* Reassembly: append an in-order segment to the message arriving at the
+   endpoint and give the message to layer 5 with its last segment */
+void reasm_add(struct endpoint *e, struct pkt *packet)
 {
-  seq_expect_send_A = 0;
-  seq_expect_recv_A = 0;
-	is_waiting_A = 0;
-  time_ret_pkt_sentA = 0;
-  ret_A = 0;
-  total_received_ACKs = 0;
+  struct msg message;
+
+  if (e->reasmlen == 0 && !packet->more) {
+    message.length = packet->length;  /* a message in one segment: no copy */
+    message.data = packet->payload;
+    tolayer5(e->id, message);
+    return;
+  }
+  if (e->reasmlen + packet->length > e->reasmcap) {
+    e->reasmcap = 2 * (e->reasmlen + packet->length);
+    e->reasm = (char *)realloc(e->reasm, e->reasmcap);
+  }
+  pktcopy(e->reasm + e->reasmlen, packet->payload, packet->length);
+  e->reasmlen += packet->length;
+  if (packet->more)
+    return;
+  message.length = e->reasmlen;
+  message.data = e->reasm;
+  tolayer5(e->id, message);
+  e->reasmlen = 0;
 }
 
+/* called from layer 5 at endpoint id, passed the data to be sent to the other end */
+void ep_output(int id, struct msg message)
+{
+	struct endpoint *e = &ep[id];
+	int i;
+
+	/* If the endpoint is waiting for a packet to arrive, ignore the message */
+	if (e->is_waiting) {
+    if (BACKPRESSURE) {
+      tracef(1, YEL "Currently waiting for ACK from packet sent to %s. Layer 5 has to wait\n" RESET, epname(id ^ 1));
+      blocklayer5(id);
+      return;
+    }
+    tracef(1, YEL "Currently waiting for ACK from packet sent to %s. Ignore\n" RESET, epname(id ^ 1));
+    stats.bufferdrops++;
+    return;
+  }
+
+	/* Keep the message, cut into segments, and send the first one. */
+	/* The previous message is all ACKed, its segments can go.       */
+	for (i = 0; i < e->nseg; i++)
+		pktbuf_release(e->segbuf[i]);
+	e->nseg = segments(message.length);
+	if (e->nseg > e->segcap) {
+		e->segcap = e->nseg;
+		e->segbuf = (char **)realloc(e->segbuf, e->segcap * sizeof(char *));
+	}
+	for (i = 0; i < e->nseg; i++) {
+		e->segbuf[i] = pktbuf_alloc();
+		pktcopy(e->segbuf[i], message.data + i * MSS,
+		        message.length - i * MSS < MSS ? message.length - i * MSS : MSS);
+	}
+	e->sendlen = message.length;
+	e->sendoff = 0;
+	send_segment(e);
+}
 
-/* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(packet)
-struct pkt packet;
+/* called from layer 3, when a packet arrives for layer 4 at endpoint id */
+void ep_input(int id, struct pkt packet)
 {
-    if (DEBUG)
-		print_pkt("Received at B", packet);
+  struct endpoint *e = &ep[id];
+
+    if (TRACING(1))
+		print_pkt("Received at", id, packet);
 
     int ans_checksum = packet.checksum;
     packet.checksum = 0;
-    if (compute_check_sum(packet) != ans_checksum) {
-          printf(RED);
-          print_pkt("Checksum error at B", packet);
-          printf(RESET);
-          struct pkt nakpkt;
-          nakpkt.acknum = -1;
-          nakpkt.isACK = 1;
-          nakpkt.checksum = 0;
-          nakpkt.checksum = compute_check_sum(nakpkt);
-          printf(YEL);
-          printf("Sent NAK from B\n");
-          printf(RESET);
-          //last_sent_from_B = nakpkt;
-          tolayer3(1, nakpkt);
+    if (compute_check_sum(&packet) != ans_checksum) {
+          if (TRACING(1)) {
+            printf(RED);
+            print_pkt("Checksum error at", id, packet);
+            printf(RESET);
+          }
+          struct pkt nakpkt = make_ack(e->conn, -1);
+          tracef(1, YEL "Sent NAK from %s\n" RESET, epname(id));
+          stats.naks++;
+          tolayer3(id, nakpkt);
       return;
     }
     packet.checksum = ans_checksum;
 
     if(packet.isACK == 1) {
-        if (packet.acknum > -1 && is_waiting_B == 1)
-            stoptimer(1);
-          if (packet.acknum == seq_expect_send_B) {	/* ACK */
-            if (ret_B == 1) {
-              printf(GRN);
-              printf("B just received ACK from A for a packet originally retransmitted at time %f\n", time_ret_pkt_sentB);
-              printf(RESET);
-              ret_B = 0;
+        if (packet.acknum == e->seq_expect_send && e->is_waiting == 1) {	/* ACK */
+            stoptimer(id);
+            rtt_ack(&e->rtt, e->sent_time, e->resent);
+            if (e->ret == 1) {
+              tracef(1, GRN "%s just received ACK from %s for a packet originally retransmitted at time %f\n" RESET, epname(id), epname(id ^ 1), e->time_ret_pkt_sent);
+              e->ret = 0;
             }
             total_received_ACKs++;
-            printf(GRN);
-            printf("Total successful ACKs: %d\n", total_received_ACKs);
-            printf(RESET);
-            seq_expect_send_B = 1 - seq_expect_send_B;
-            is_waiting_B = 0;
+            tracef(2, GRN "Total successful ACKs: %d\n" RESET, total_received_ACKs);
+            e->seq_expect_send = 1 - e->seq_expect_send;
+            if (e->waiting_packet.more) {	/* on to the next segment */
+              e->sendoff += e->waiting_packet.length;
+              send_segment(e);
+            } else {
+              e->is_waiting = 0;
+              unblocklayer5(id);
+            }
         } else if (packet.acknum == -1) {		/* NAK */
-          // printf(YEL);
-          // printf("Received NAK\n");
-          // printf("Retransmitting from B\n");
-          // printf(RESET);
-          // last_sent_from_B = waiting_packet_B;
-          // tolayer3(1, waiting_packet_B);
-          // stoptimer(1);
-          // starttimer(1, TIME_OUT);
-          printf(YEL);
-          printf("Received NAK\n");
-          printf("Retransmitting last sent packet from B\n");
-          printf(RESET);
-          tolayer3(1, last_sent_from_B);
+            tracef(1, YEL "Received NAK\n");
+            tracef(1, "Retransmitting last sent packet from %s\n", epname(id));
+            if (!e->last_sent_from.isACK) {
+              stats.retransmits++;
+              stats.retransbytes += PKT_BYTES(e->last_sent_from);
+              e->resent = RESENT_NAK;
+            }
+            tracef(1, RESET);
+            tolayer3(id, e->last_sent_from);
         }
-    } else if (packet.seqnum == seq_expect_recv_B) {
-  		/* Pass data to layer5 */
-  		struct msg message;
-  		memcpy(message.data, packet.payload, sizeof(packet.payload));
-  		tolayer5(1, message);
-  		seq_expect_recv_B = 1 - seq_expect_recv_B;
+    }else if (packet.seqnum == e->seq_expect_recv) {
+  		/* Pass data to layer5 once its message is complete */
+  		reasm_add(e, &packet);
+  		e->seq_expect_recv = 1 - e->seq_expect_recv;
   		/* Debug output */
-  		if (DEBUG)
-  			print_pkt("Accpeted at B", packet);
-      last_accepted_packet_B = packet;
-      /* Send ACK to A side */
-      struct pkt ackpkt;
-      ackpkt.isACK = 1;
-      ackpkt.acknum = packet.seqnum;
-      ackpkt.checksum = 0;
-      ackpkt.checksum = compute_check_sum(ackpkt);
-      last_sent_from_B = ackpkt;
-      tolayer3(1, ackpkt);
-    } else if (packet.seqnum != seq_expect_recv_B) {
-      printf(YEL);
-      printf("Received unexpected seqnum.\n");
-      printf("Previous ACk probably didn't arrive.\n");
-      printf("Resent ACK to A.\n");
-      printf(RESET);
-      struct pkt ackpkt;
-      ackpkt.isACK = 1;
-      ackpkt.acknum = last_accepted_packet_B.seqnum;
-      ackpkt.checksum = 0;
-      ackpkt.checksum = compute_check_sum(ackpkt);
-      last_sent_from_B = ackpkt;
-      tolayer3(1, ackpkt);
+  		if (TRACING(1))
+  			print_pkt("Accpeted at", id, packet);
+      e->last_accepted_packet = packet;
+      /* Send ACK to the sender */
+      struct pkt ackpkt = make_ack(e->conn, packet.seqnum);
+      e->last_sent_from = ackpkt;
+      tolayer3(id, ackpkt);
+    } else if (packet.seqnum != e->seq_expect_recv) {
+      tracef(1, YEL "Received unexpected seqnum.\n"
+                "Previous ACK probably didn't arrive.\n"
+                "Resent ACK to %s.\n" RESET, epname(id ^ 1));
+      struct pkt ackpkt = make_ack(e->conn, e->last_accepted_packet.seqnum);
+      e->last_sent_from = ackpkt;
+      tolayer3(id, ackpkt);
     } else {
       exit(1);
     }
 }
 
-/* called when B's timer goes off */
-void B_timerinterrupt()
+/* called when the timer of endpoint id goes off */
+void ep_timerinterrupt(int id)
 {
-  printf(YEL);
-  printf("Retransmitted from B\n");
-  printf(RESET);
-  last_sent_from_B = waiting_packet_B;
-  tolayer3(1, waiting_packet_B);
-  if(ret_B == 0) {
-    time_ret_pkt_sentB = time;
-    ret_B = 1;
+  struct endpoint *e = &ep[id];
+
+  rtt_timeout(&e->rtt, e->resent == RESENT_TIMEOUT);
+  e->resent = RESENT_TIMEOUT;
+  tracef(1, YEL "Retransmitted from %s\n" RESET, epname(id));
+  stats.retransmits++;
+  stats.retransbytes += PKT_BYTES(e->waiting_packet);
+  e->last_sent_from = e->waiting_packet;
+	tolayer3(id, e->waiting_packet);
+  if (e->ret == 0) {
+    e->time_ret_pkt_sent = simtime;
+    e->ret = 1;
   }
-  starttimer(1, TIME_OUT);
+	starttimer(id, e->rtt.rto);
 }
 
-/* the following rouytine will be called once (only) before any other */
-/* entity B routines are called. You can use it to do any initialization */
-void B_init()
+/* the following routine will be called once (only) for each entity before */
+/* any other endpoint routines are called. You can use it to do any       */
+/* initialization.  Endpoint id is one end of connection conn, and         */
+/* endpoint id ^ 1 the other; packets go to it with conn in their header.  */
+void ep_init(int id, int conn)
 {
-  seq_expect_send_B = 0;
-  seq_expect_recv_B = 0;
-	is_waiting_B = 0;
-  time_ret_pkt_sentB = 0;
-  ret_B = 0;
+  struct endpoint *e;
+  int n;
+
+  if (PROTOCOL != PROTO_SW) {
+    simabort("project2_stop_wait only implements stop-and-wait, use project2_gbn for %s\n", protoname[PROTOCOL]);
+  }
+  if (id >= nep) {	/* grow the table; new endpoints start out zeroed */
+    for (n = nep > 0 ? 2 * nep : 2; n <= id; n *= 2)
+      ;
+    ep = (struct endpoint *)realloc(ep, n * sizeof(struct endpoint));
+    memset(ep + nep, 0, (n - nep) * sizeof(struct endpoint));
+    nep = n;
+  }
+  if (id == 0)
+    total_received_ACKs = 0;
+  e = &ep[id];
+  e->id = id;
+  e->conn = conn;
+  e->seq_expect_send = 0;
+  e->seq_expect_recv = 0;
+	e->is_waiting = 0;
+  e->time_ret_pkt_sent = 0;
+  e->ret = 0;
+  memset(&e->last_accepted_packet, 0, sizeof(struct pkt));
+  memset(&e->last_sent_from, 0, sizeof(struct pkt));
+  memset(&e->waiting_packet, 0, sizeof(struct pkt));
+  e->last_sent_from.conn = e->waiting_packet.conn = conn;
+  rtt_init(&e->rtt);
+  e->reasmlen = 0;
+  e->nseg = 0;		/* siminit() took back the buffers of a previous run */
 }
 /*****************************************************************
 ***************** NETWORK EMULATION CODE STARTS BELOW ***********
@@ -448,27 +980,68 @@ the emulator, you're welcome to look at the code - but again, you should have
 to, and you definitely should not have to modify
 ******************************************************************/
 
-int main()
+int main(int argc, char **argv)
+{
+   if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+      evqbench();
+      printf("\n");
+      cksumbench();
+      printf("\n");
+      entitybench();
+      printf("\n");
+      backlogbench();
+      printf("\n");
+      flowbench();
+      printf("\n");
+      tracebench();
+      printf("\n");
+      return clockbench();
+   }
+
+   init(argc, argv);
+   if (sweepfile != NULL)
+      return sweep();
+   siminit();
+   if (tracefile != NULL)
+      traceopen(tracefile);
+   initendpoints();
+   simulate();
+   traceclose();
+
+   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",simtime,nsim);
+   printf(" Event pool: %ld allocations, %ld chunks malloc'd, peak %d events in use\n",
+          evallocs, evchunks, evpeak);
+   printf(" Payload pool: %ld allocations, %ld chunks malloc'd, peak %d buffers in use\n",
+          pballocs, pbchunks, pbpeak);
+   statsreport(stdout, 0);
+   if (statsjson != NULL) {
+      FILE *fp = strcmp(statsjson, "-") == 0 ? stdout : fopen(statsjson, "w");
+      if (fp == NULL) {
+         printf("Cannot create %s\n", statsjson);
+         return 1;
+         }
+      statsreport(fp, 1);
+      if (fp != stdout)
+         fclose(fp);
+      }
+   return 0;
+}
+
+/* run the simulation set up by siminit() until nsimmax messages are sent */
+void simulate()
 {
    struct event *eventptr;
-   struct msg  msg2give;
    struct pkt  pkt2give;
+   struct pending *q;
+   struct channel *chan;
 
-   int i,j;
-   char c;
-
-   init();
-   A_init();
-   B_init();
+   int i, e;
 
    while (1) {
-        eventptr = evlist;            /* get next event to simulate */
+        eventptr = nextevent();       /* get next event to simulate */
         if (eventptr==NULL)
-           goto terminate;
-        evlist = evlist->next;        /* remove this event from event list */
-        if (evlist!=NULL)
-           evlist->prev=NULL;
-        if (TRACE>=2) {
+           return;
+        if (TRACING(2)) {
            printf("\nEVENT time: %f,",eventptr->evtime);
            printf("  type: %d",eventptr->evtype);
            if (eventptr->evtype==0)
@@ -479,79 +1052,444 @@ int main()
 	     printf(", fromlayer3 ");
            printf(" entity: %d\n",eventptr->eventity);
            }
-        time = eventptr->evtime;        /* update time to next event time */
-        if (nsim==nsimmax)
-	  break;                        /* all done with simulation */
+        if (eventptr->evtime < simtime) {
+           simabort("INTERNAL PANIC: event at time %f, after the clock reached %f\n",
+                    (double)eventptr->evtime, (double)simtime);
+           }
+        if (eventptr->evtime == simtime && simtime > 0)
+           stats.clockties++;
+        simtime = eventptr->evtime;     /* update time to next event time */
+        if (nsim==nsimmax) {
+          freeevent(eventptr);
+	  return;                       /* all done with simulation */
+          }
         if (eventptr->evtype == FROM_LAYER5 ) {
+            if (tracefp != NULL)
+               tracerecord(TR_LAYER5, eventptr->eventity, NULL, nsim);
+            e = eventptr->eventity;
             generate_next_arrival();   /* set up future arrival */
-            /* fill in msg to give with string of same letter */
-            j = nsim % 26;
-            for (i=0; i<20; i++)
-               msg2give.data[i] = 97 + j;
-            if (TRACE>2) {
-               printf("          MAINLOOP: data given to student: ");
-                 for (i=0; i<20; i++)
-                  printf("%c", msg2give.data[i]);
-               printf("\n");
-	     }
+            /* the message is its length in copies of the same letter */
+            q = pendnew(&port[e]);
+            q->time = simtime;
+            q->data = 97 + nsim % 26;
+            q->length = MSGLEN;
+            if (MSGLENMAX > MSGLEN)
+               q->length += (int)(rnd(RNG_LENGTH) * (MSGLENMAX - MSGLEN + 1));
+            if (TRACING(3))
+               printf("          MAINLOOP: data given to student: %d bytes of %c\n",
+                      q->length, q->data);
             nsim++;
-            if (eventptr->eventity == A)
-               A_output(msg2give);
-             else
-               B_output(msg2give);
             }
           else if (eventptr->evtype ==  FROM_LAYER3) {
-            pkt2give.seqnum = eventptr->pktptr->seqnum;
-            pkt2give.acknum = eventptr->pktptr->acknum;
-            pkt2give.isACK = eventptr->pktptr->isACK;
-            pkt2give.checksum = eventptr->pktptr->checksum;
-            for (i=0; i<20; i++)
-                pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-   	       A_input(pkt2give);            /* appropriate entity */
-            else
-   	       B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
+            chan = &host[eventptr->eventity].chan;
+            chan->inflight--;
+            for (i = 0; i < chan->nheld; i++)     /* a held packet that no later one overtook */
+               if (chan->held[i] == eventptr) {
+                  chan->held[i] = chan->held[--chan->nheld];
+                  chan->heldleft[i] = chan->heldleft[chan->nheld];
+                  break;
+                  }
+            host[eventptr->eventity].lastactivity = simtime;
+            e = -1;
+            if (!pkt_parse(eventptr->hdr, eventptr->wirelen, eventptr->payload, &pkt2give)
+                || (e = flowlookup(pkt2give.conn, eventptr->eventity, eventptr->evsrc)) < 0) {
+               stats.malformed++;        /* the receiving link layer drops it */
+               tracef(1, RED "          FROMLAYER3: malformed frame dropped\n" RESET);
+               }
+             else {
+               if (tracefp != NULL)
+                  tracerecord(TR_ARRIVE, e, &pkt2give, TRO_OK);
+               /* deliver packet by calling the receiving endpoint */
+   	       ep_input(e, pkt2give);
+               }
             }
           else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-            if (eventptr->eventity == A)
-	       A_timerinterrupt();
-             else
-	       B_timerinterrupt();
+            e = eventptr->eventity;
+            port[e].timer = NULL;  /* it has gone off */
+            evtimerops++;
+            stats.timeouts++;
+            stats.idle += simtime - host[flowtab[e >> 1].end[e & 1]].lastactivity;
+            if (tracefp != NULL)
+               tracerecord(TR_TIMEOUT, e, NULL, TRO_OK);
+	    ep_timerinterrupt(e);
              }
           else  {
 	     printf("INTERNAL PANIC: unknown event type \n");
+             e = -1;
              }
-        free(eventptr);
+        if (e >= 0)
+           feedlayer5(e);     /* new message, or the sender has room again */
+        freeevent(eventptr);
         }
+}
 
-terminate:
-   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",time,nsim);
-   return 0;
+
+
+void usage()
+{
+   printf("usage: simulator [options]   (no options: prompt for the basic ones)\n");
+   printf("  -n N              number of messages to simulate\n");
+   printf("  -loss P           packet loss probability\n");
+   printf("  -corrupt P        packet corruption probability\n");
+   printf("  -link L           uniform (1-10 units behind the packet ahead) or queue\n");
+   printf("  -bandwidth R      queue: bytes per time unit, 0: no limit\n");
+   printf("  -delay T          queue: propagation delay\n");
+   printf("  -queue N          queue: packets it holds before tail drop, 0: no limit\n");
+   printf("  -gebad P          Gilbert-Elliott burst loss: P(good -> bad) per packet\n");
+   printf("  -gegood P         P(bad -> good); -loss is the loss in the good state\n");
+   printf("  -badloss P        loss probability in the bad state (default 1)\n");
+   printf("  -reorder P        probability that a packet is held back behind later ones\n");
+   printf("  -reorderdepth N   ... behind 1 to N of them (default 3)\n");
+   printf("  -duplicate P      probability that a packet arrives twice\n");
+   printf("                    these and -loss take _ab or _ba for one direction\n");
+   printf("  -lambda T         average time between messages from layer5\n");
+   printf("  -msglen N         bytes per message (default 20)\n");
+   printf("  -msglenmax N      ... or uniform from -msglen to N bytes\n");
+   printf("  -mss N            most payload bytes per segment (default 20)\n");
+   printf("  -seqbits N        sequence number bits on the wire, 1..31 (default 16)\n");
+   printf("  -trace N          TRACE level\n");
+   printf("  -timeout T        retransmission timeout (the initial one if adaptive)\n");
+   printf("  -rto R            fixed (always the timeout) or adaptive\n");
+   printf("  -window N         sender window size\n");
+   printf("  -cc C             congestion control: fixed (the window) or reno\n");
+   printf("  -buffer N         sender buffer size\n");
+   printf("  -buffermax N      let a full sender buffer double up to N slots\n");
+   printf("  -backpressure B   1: a full sender makes layer 5 wait, 0: drops\n");
+   printf("  -seed N           random number generator seed\n");
+   printf("  -tracefile FILE   write a binary event trace (see trace_decode)\n");
+   printf("  -json FILE        also write the statistics as JSON (\"-\": stdout)\n");
+   printf("  -bidirectional B  1: messages arrive at A and B, 0: only at A\n");
+   printf("  -endpoints N      entities in the network (default 2, A and B)\n");
+   printf("  -traffic T        who sends to whom: pairs (0 and 1, 2 and 3 ..., the\n");
+   printf("                    odd ones only with -bidirectional 1), ring (each to\n");
+   printf("                    the next) or a FILE of \"src dst rate\" lines\n");
+   printf("  -flows N          connections for each pair the traffic matrix names,\n");
+   printf("                    sharing the link (default 1)\n");
+   printf("  -protocol P       sw, gbn or sr (selective repeat)\n");
+   printf("  -sack B           1: ACKs carry a selective acknowledgment bitmap\n");
+   printf("  -config FILE      read \"name value\" lines using the names above\n");
+   printf("  -sweep FILE       run every combination of the \"name value ...\"\n");
+   printf("                    lines in FILE, one result row per run\n");
+   printf("  -threads N        worker threads for -sweep (default: all CPUs)\n");
+   printf("  -bench            benchmark the event queue, the checksum, the\n");
+   printf("                    simulation as the number of endpoints grows, the\n");
+   printf("                    throughput under a sustained backlog and\n");
+   printf("                    finding the connection of a packet as they grow,\n");
+   printf("                    the cost of -tracefile, then check the clock over\n");
+   printf("                    a long run (exit 1 if bad)\n");
+}
+
+/* set a link parameter for the directions towards entities first..last, */
+/* 0 if the name is unknown                                              */
+int setlinkparam(char *name, char *value, int first, int last)
+{
+   int i;
+
+   for (i = first; i <= last; i++) {
+      if (strcmp(name, "link") == 0) {
+         for (linkcfg[i].model = 0; linkname[linkcfg[i].model] != NULL
+                                 && strcmp(linkname[linkcfg[i].model], value) != 0; linkcfg[i].model++)
+            ;
+         if (linkname[linkcfg[i].model] == NULL) {
+            simabort("Unknown link model %s, use uniform or queue\n", value);
+            }
+         }
+      else if (strcmp(name, "bandwidth") == 0)
+         linkcfg[i].bandwidth = atof(value);
+      else if (strcmp(name, "delay") == 0)
+         linkcfg[i].delay = atof(value);
+      else if (strcmp(name, "queue") == 0)
+         linkcfg[i].queuemax = atoi(value);
+      else if (strcmp(name, "loss") == 0)
+         linkcfg[i].loss = atof(value);
+      else if (strcmp(name, "gebad") == 0)
+         linkcfg[i].gebad = atof(value);
+      else if (strcmp(name, "gegood") == 0)
+         linkcfg[i].gegood = atof(value);
+      else if (strcmp(name, "badloss") == 0)
+         linkcfg[i].badloss = atof(value);
+      else if (strcmp(name, "reorder") == 0)
+         linkcfg[i].reorder = atof(value);
+      else if (strcmp(name, "reorderdepth") == 0)
+         linkcfg[i].reorderdepth = atoi(value) > 0 ? atoi(value) : 1;
+      else if (strcmp(name, "duplicate") == 0)
+         linkcfg[i].duplicate = atof(value);
+      else
+         return 0;
+      }
+   return 1;
+}
+
+/* set one run parameter by its option name, 0 if the name is unknown. */
+/* A bad value is fatal: it ends the program, or in a sweep the run.    */
+/* File names are kept, not copied, so value has to outlive the runs:   */
+/* it is an argv string, a sweep value or a copy readconfig() made.     */
+int setparam(char *name, char *value)
+{
+   char base[64];
+   int i, n;
+
+   n = strlen(name);
+   if (n > 3 && n < (int)sizeof(base) && (strcmp(name+n-3, "_ab") == 0 || strcmp(name+n-3, "_ba") == 0)) {
+      memcpy(base, name, n-3);
+      base[n-3] = '\0';
+      i = name[n-1] == 'b' ? B : A;       /* the receiving entity */
+      return setlinkparam(base, value, i, i);
+      }
+   if (strcmp(name, "n") == 0)
+      nsimmax = atoi(value);
+   else if (strcmp(name, "loss") == 0)
+      lossprob = atof(value);
+   else if (strcmp(name, "corrupt") == 0)
+      corruptprob = atof(value);
+   else if (strcmp(name, "lambda") == 0)
+      lambda = atof(value);
+   else if (strcmp(name, "trace") == 0)
+      TRACE = atoi(value);
+   else if (strcmp(name, "timeout") == 0)
+      TIME_OUT = atof(value);
+   else if (strcmp(name, "window") == 0)
+      WINDOW_SIZE = atoi(value);
+   else if (strcmp(name, "buffer") == 0)
+      BUFFER_SIZE = atoi(value);
+   else if (strcmp(name, "buffermax") == 0)
+      BUFFER_MAX = atoi(value);
+   else if (strcmp(name, "backpressure") == 0)
+      BACKPRESSURE = atoi(value);
+   else if (strcmp(name, "seed") == 0)
+      seed = strtoul(value, NULL, 10);
+   else if (strcmp(name, "bidirectional") == 0)
+      BIDIRECTIONAL = atoi(value);
+   else if (strcmp(name, "endpoints") == 0) {
+      NENTITY = atoi(value);
+      if (NENTITY < 2) {
+         simabort("endpoints %s is less than 2\n", value);
+         }
+      }
+   else if (strcmp(name, "flows") == 0) {
+      FLOWS = atoi(value);
+      if (FLOWS < 1) {
+         simabort("flows %s is less than 1\n", value);
+         }
+      }
+   else if (strcmp(name, "traffic") == 0)
+      traffic = strcmp(value, "pairs") == 0 ? NULL : value;
+   else if (strcmp(name, "protocol") == 0) {
+      for (i = 0; protoname[i] != NULL && strcmp(protoname[i], value) != 0; i++)
+         ;
+      if (protoname[i] == NULL) {
+         simabort("Unknown protocol %s\n", value);
+         }
+      PROTOCOL = i;
+      }
+   else if (strcmp(name, "sack") == 0)
+      SACK = atoi(value);
+   else if (strcmp(name, "rto") == 0) {
+      if (strcmp(value, "fixed") != 0 && strcmp(value, "adaptive") != 0) {
+         simabort("Unknown rto %s, use fixed or adaptive\n", value);
+         }
+      ADAPTIVE_RTO = strcmp(value, "adaptive") == 0;
+      }
+   else if (strcmp(name, "cc") == 0) {
+      for (i = 0; ccname[i] != NULL && strcmp(ccname[i], value) != 0; i++)
+         ;
+      if (ccname[i] == NULL) {
+         simabort("Unknown congestion control %s, use fixed or reno\n", value);
+         }
+      CONGESTION = i;
+      }
+   else if (strcmp(name, "mss") == 0) {
+      MSS = atoi(value);
+      if (MSS < 1 || MSS > MSS_MAX) {
+         simabort("mss %s is not in 1..%d\n", value, MSS_MAX);
+         }
+      }
+   else if (strcmp(name, "seqbits") == 0) {
+      SEQBITS = atoi(value);
+      if (SEQBITS < 1 || SEQBITS > 31) {
+         simabort("seqbits %s is not in 1..31\n", value);
+         }
+      }
+   else if (strcmp(name, "msglen") == 0)
+      MSGLEN = atoi(value);
+   else if (strcmp(name, "msglenmax") == 0)
+      MSGLENMAX = atoi(value);
+   else if (strcmp(name, "tracefile") == 0)
+      tracefile = value;
+   else if (strcmp(name, "json") == 0)
+      statsjson = value;
+   else if (strcmp(name, "sweep") == 0)
+      sweepfile = value;
+   else if (strcmp(name, "threads") == 0)
+      nthreads = atoi(value);
+   else
+      return setlinkparam(name, value, A, B);
+   return 1;
+}
+
+/* config file: one "name value" or "name = value" per line, # comments */
+void readconfig(char *file)
+{
+   FILE *fp;
+   char line[256], name[64], value[64], *cp;
+   int lineno = 0;
+
+   if ((fp = fopen(file, "r")) == NULL) {
+      printf("Cannot open config file %s\n", file);
+      exit(1);
+      }
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      lineno++;
+      if ((cp = strchr(line, '#')) != NULL)
+         *cp = '\0';
+      for (cp = line; *cp; cp++)
+         if (*cp == '=')
+            *cp = ' ';
+      if (sscanf(line, "%63s %63s", name, value) != 2)
+         continue;
+      if (!setparam(name, strdup(value))) {      /* read once, kept for good */
+         printf("%s:%d: unknown parameter %s\n", file, lineno, name);
+         exit(1);
+         }
+      }
+   fclose(fp);
+}
+
+/* set the run parameters from the command-line options */
+void parseoptions(int argc, char **argv)
+{
+   int i;
+
+   nsimmax = 1000;
+   lossprob = 0.0;
+   corruptprob = 0.0;
+   lambda = 10.0;
+   for (i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-config") == 0 && i+1 < argc)
+         readconfig(argv[++i]);
+      else if (argv[i][0] == '-' && i+1 < argc && setparam(argv[i]+1, argv[i+1]))
+         i++;
+      else {
+         printf("Unknown or incomplete option %s\n", argv[i]);
+         usage();
+         exit(1);
+         }
+      }
+}
+
+/* copy the run parameters of this thread into p */
+void paramsave(struct params *p)
+{
+   p->nsimmax = nsimmax;
+   p->lossprob = lossprob;
+   p->corruptprob = corruptprob;
+   p->lambda = lambda;
+   p->TRACE = TRACE;
+   p->TIME_OUT = TIME_OUT;
+   p->WINDOW_SIZE = WINDOW_SIZE;
+   p->BUFFER_SIZE = BUFFER_SIZE;
+   p->BUFFER_MAX = BUFFER_MAX;
+   p->BACKPRESSURE = BACKPRESSURE;
+   p->seed = seed;
+   p->BIDIRECTIONAL = BIDIRECTIONAL;
+   p->NENTITY = NENTITY;
+   p->FLOWS = FLOWS;
+   p->traffic = traffic;
+   p->PROTOCOL = PROTOCOL;
+   p->SACK = SACK;
+   p->ADAPTIVE_RTO = ADAPTIVE_RTO;
+   p->CONGESTION = CONGESTION;
+   p->MSS = MSS;
+   p->MSGLEN = MSGLEN;
+   p->MSGLENMAX = MSGLENMAX;
+   p->SEQBITS = SEQBITS;
+   memcpy(p->linkcfg, linkcfg, sizeof(linkcfg));
 }
 
+/* set every run parameter of this thread from p */
+void paramload(struct params *p)
+{
+   nsimmax = p->nsimmax;
+   lossprob = p->lossprob;
+   corruptprob = p->corruptprob;
+   lambda = p->lambda;
+   TRACE = p->TRACE;
+   TIME_OUT = p->TIME_OUT;
+   WINDOW_SIZE = p->WINDOW_SIZE;
+   BUFFER_SIZE = p->BUFFER_SIZE;
+   BUFFER_MAX = p->BUFFER_MAX;
+   BACKPRESSURE = p->BACKPRESSURE;
+   seed = p->seed;
+   BIDIRECTIONAL = p->BIDIRECTIONAL;
+   NENTITY = p->NENTITY;
+   FLOWS = p->FLOWS;
+   traffic = p->traffic;
+   PROTOCOL = p->PROTOCOL;
+   SACK = p->SACK;
+   ADAPTIVE_RTO = p->ADAPTIVE_RTO;
+   CONGESTION = p->CONGESTION;
+   MSS = p->MSS;
+   MSGLEN = p->MSGLEN;
+   MSGLENMAX = p->MSGLENMAX;
+   SEQBITS = p->SEQBITS;
+   memcpy(linkcfg, p->linkcfg, sizeof(linkcfg));
+}
 
+void init(int argc, char **argv)    /* read the simulation parameters */
+{
+   if (argc > 1) {                  /* batch run: no prompts */
+      parseoptions(argc, argv);
+      /* a sweep writes nothing but its CSV to stdout */
+      fprintf(sweepfile != NULL ? stderr : stdout, "-----  Network Simulator Version 1.1 -------- \n\n");
+      }
+    else {
+      printf("-----  Network Simulator Version 1.1 -------- \n\n");
+      printf("Enter the number of messages to simulate: ");
+      scanf("%d",&nsimmax);
+      printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+      scanf("%f",&lossprob);
+      printf("Enter packet corruption probability [0.0 for no corruption]:");
+      scanf("%f",&corruptprob);
+      printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
+      scanf("%f",&lambda);
+      printf("Enter TRACE:");
+      scanf("%d",&TRACE);
+      }
+}
 
-void init()                         /* initialize the simulator */
+void siminit()                      /* initialize the simulator */
 {
+  struct event *p;
   int i;
   float sum, avg;
   float jimsrand();
 
+   while ((p = nextevent()) != NULL)   /* left over from a previous run */
+      freeevent(p);
+   wheeltick = 0;
+   evcount = 0;
+   evremoves = 0;
+   evtimerops = 0;
+   evheapops = 0;
+   evallocs = 0;
+   evinuse = 0;
+   evpeak = 0;
+   pktbuf_reset();
+   nsim = 0;
+   memset(&stats, 0, sizeof(stats));
+   ntolayer3 = 0;               /* a run aborted from here on reports zeros, */
+   nlost = 0;                   /* not what the one before it counted        */
+   ncorrupt = 0;
+   total_received_ACKs = 0;
+   simtime=0.0;                 /* initialize time to 0.0 */
+   trafficinit();
+   latency = (float *)realloc(latency, (nsimmax+1)*sizeof(float));
+   if (MSGLEN < 0 || MSGLENMAX < 0) {
+      simabort("Message lengths can't be negative\n");
+      }
+   msgbuf = (char *)realloc(msgbuf, (MSGLENMAX > MSGLEN ? MSGLENMAX : MSGLEN) + 1);
 
-   printf("-----  Network Simulator Version 1.1 -------- \n\n");
-   printf("Enter the number of messages to simulate: ");
-   scanf("%d",&nsimmax);
-   printf("Enter  packet loss probability [enter 0.0 for no loss]:");
-   scanf("%f",&lossprob);
-   printf("Enter packet corruption probability [0.0 for no corruption]:");
-   scanf("%f",&corruptprob);
-   printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
-   scanf("%f",&lambda);
-   printf("Enter TRACE:");
-   scanf("%d",&TRACE);
-
-   srand(9999);              /* init random number generator */
+   rnginit(seed);            /* init random number generator */
    sum = 0.0;                /* test random number generator for students */
    for (i=0; i<1000; i++)
       sum=sum+jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -563,25 +1501,93 @@ void init()                         /* initialize the simulator */
     exit(1);
     }
 
-   ntolayer3 = 0;
-   nlost = 0;
-   ncorrupt = 0;
-
-   time=0.0;                    /* initialize time to 0.0 */
    generate_next_arrival();     /* initialize event list */
 }
 
+/* give up on the current simulation, saying why as printf() would: a  */
+/* sweep records it as aborted, gives the reason on stderr and carries  */
+/* on with the next one, a single run prints the reason and exits       */
+void simabort(char *fmt, ...)
+{
+   char why[256];
+   va_list ap;
+
+   va_start(ap, fmt);
+   vsnprintf(why, sizeof(why), fmt, ap);
+   va_end(ap);
+   if (simrun >= 0)
+      fprintf(stderr, "run %ld: %s", simrun, why);
+    else
+      printf("%s", why);
+   if (simescape != NULL)
+      longjmp(*simescape, 1);
+   exit(1);
+}
+
 /****************************************************************************/
-/* jimsrand(): return a float in range [0,1].  The routine below is used to */
-/* isolate all random number generation in one location.  We assume that the*/
-/* system-supplied rand() function return an int in therange [0,mmm]        */
+/* rnd(stream): return a double in range [0,1) from one of the RNG_ streams. */
+/* The routines below isolate all random number generation in one location. */
+/* The generator is xoshiro256** (Blackman and Vigna): it gives the same    */
+/* numbers on every platform.  Stream 0 is seeded through splitmix64 and    */
+/* each next stream starts 2^128 numbers further on, so they never overlap. */
 /****************************************************************************/
+uint64_t rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+uint64_t xoshiro(uint64_t *s)
+{
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+void rnginit(uint64_t seed)
+{
+  static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                   0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+  uint64_t s[4], z;
+  int i, j, b;
+
+  for (i = 0; i < 4; i++) {           /* splitmix64 */
+    z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rngstate[0][i] = z ^ (z >> 31);
+    }
+  for (i = 1; i < RNG_STREAMS; i++) {
+    memcpy(s, rngstate[i-1], sizeof(s));
+    memset(rngstate[i], 0, sizeof(rngstate[i]));
+    for (j = 0; j < 4; j++)
+      for (b = 0; b < 64; b++) {
+        if (jump[j] >> b & 1) {
+          rngstate[i][0] ^= s[0];
+          rngstate[i][1] ^= s[1];
+          rngstate[i][2] ^= s[2];
+          rngstate[i][3] ^= s[3];
+          }
+        xoshiro(s);
+        }
+    }
+}
+
+double rnd(int stream)
+{
+  return (xoshiro(rngstate[stream]) >> 11) * 0x1.0p-53;
+}
+
+/* jimsrand(): return a float in range [0,1], from the RNG_MISC stream */
 float jimsrand()
 {
-  double mmm = RAND_MAX;   /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
-  float x;                   /* individual students may need to change mmm */
-  x = rand()/mmm;            /* x should be uniform in [0,1] */
-  return(x);
+  return rnd(RNG_MISC);
 }
 
 /********************* EVENT HANDLINE ROUTINES *******/
@@ -593,72 +1599,933 @@ void generate_next_arrival()
    double x;
    struct event *evptr;
    float ttime;
-   int tempint;
+   int tempint, lo, hi, mid;
 
-   if (TRACE>2)
+   if (TRACING(3))
        printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
 
-   x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+   x = lambda*rnd(RNG_ARRIVAL)*2;  /* x is uniform on [0,2*lambda] */
                              /* having mean of lambda        */
-   evptr = (struct event *)malloc(sizeof(struct event));
-   evptr->evtime =  time + x;
+   evptr = newevent();
+   evptr->evtime =  simtime + x;
    evptr->evtype =  FROM_LAYER5;
-   if (BIDIRECTIONAL && (jimsrand()>0.5) )
-      evptr->eventity = B;
-    else
-      evptr->eventity = A;
+   if (nsources == 1)
+      evptr->eventity = sources[0];
+    else {           /* a source picked in proportion to its rate */
+      x = rnd(RNG_ENTITY)*ratesum[nsources-1];
+      for (lo = 0, hi = nsources-1; lo < hi; ) {
+         mid = (lo + hi)/2;
+         if (x < ratesum[mid])
+            hi = mid;
+          else
+            lo = mid + 1;
+         }
+      evptr->eventity = sources[lo];
+      }
    insertevent(evptr);
 }
 
-
-void insertevent(struct event *p)
+/* connection between entities a and b, whose endpoints get rate_ab */
+/* and rate_ba of the messages, relative to the others' rates          */
+void addconn(int a, int b, double rate_ab, double rate_ba)
 {
-   struct event *q,*qold;
+   struct port *p;
+   int i, n;
 
-   if (TRACE>2) {
-      printf("            INSERTEVENT: time is %lf\n",time);
-      printf("            INSERTEVENT: future time will be %lf\n",p->evtime);
+   if (a < 0 || a >= NENTITY || b < 0 || b >= NENTITY || a == b) {
+      simabort("Traffic from %d to %d: there are entities 0..%d\n", a, b, NENTITY-1);
       }
-   q = evlist;     /* q points to header of list in which p struct inserted */
-   if (q==NULL) {   /* list is empty */
-        evlist=p;
-        p->next=NULL;
-        p->prev=NULL;
-        }
-     else {
-        for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-              qold=q;
-        if (q==NULL) {   /* end of list */
-             qold->next = p;
-             p->prev = qold;
-             p->next = NULL;
-             }
-           else if (q==evlist) { /* front of list */
-             p->next=evlist;
-             p->prev=NULL;
-             p->next->prev=p;
-             evlist = p;
-             }
-           else {     /* middle of list */
-             p->next=q;
-             p->prev=q->prev;
-             q->prev->next=p;
-             q->prev=p;
-             }
-         }
+   if (nflow == CONN_MAX) {
+      simabort("More than %d connections\n", CONN_MAX);
+      }
+   if (nflow == flowmax) {           /* new ports start out zeroed */
+      n = flowmax ? 2*flowmax : 64;
+      flowtab = (struct flow *)realloc(flowtab, n*sizeof(struct flow));
+      port = (struct port *)realloc(port, 2*n*sizeof(struct port));
+      memset(port + 2*flowmax, 0, 2*(n - flowmax)*sizeof(struct port));
+      sources = (int *)realloc(sources, 2*n*sizeof(int));
+      ratesum = (double *)realloc(ratesum, 2*n*sizeof(double));
+      flowmax = n;
+      }
+   flowtab[nflow].end[0] = a;
+   flowtab[nflow].end[1] = b;
+   for (i = 0; i < 2; i++) {
+      p = &port[2*nflow + i];
+      p->rate = i ? rate_ba : rate_ab;
+      p->timer = NULL;
+      p->pendhead = p->pendtail = p->pendgive = 0;
+      p->blocked = 0;
+      p->delivered = 0;
+      p->deliveredbytes = 0;
+      }
+   nflow++;
 }
 
-void printevlist()
+/* set up the host and flow tables for a run: -flows connections for */
+/* each entry of the traffic matrix.  Each endpoint keeps the pending */
+/* slots it had in a previous run.                                    */
+void trafficinit()
 {
-  struct event *q;
-  int i;
-  printf("--------------\nEvent List Follows:\n");
+   FILE *fp;
+   char line[256];
+   int i, f, src, dst, lineno = 0;
+   double rate;
+
+   if (NENTITY > hostmax) {
+      host = (struct host *)realloc(host, NENTITY*sizeof(struct host));
+      hostmax = NENTITY;
+      }
+   memset(host, 0, NENTITY*sizeof(struct host));
+   nflow = 0;
+   if (traffic == NULL)
+      for (i = 0; i+1 < NENTITY; i += 2)
+         for (f = 0; f < FLOWS; f++)
+            addconn(i, i+1, 1.0, BIDIRECTIONAL ? 1.0 : 0.0);
+    else if (strcmp(traffic, "ring") == 0)
+      for (i = 0; i < NENTITY; i++)
+         for (f = 0; f < FLOWS; f++)
+            addconn(i, (i+1) % NENTITY, 1.0, 0.0);
+    else {
+      if ((fp = fopen(traffic, "r")) == NULL) {
+         simabort("Cannot open traffic file %s\n", traffic);
+         }
+      while (fgets(line, sizeof(line), fp) != NULL) {
+         lineno++;
+         if (strchr(line, '#') != NULL)
+            *strchr(line, '#') = '\0';
+         if (sscanf(line, "%d %d %lf", &src, &dst, &rate) != 3)
+            continue;
+         if (rate <= 0) {
+            simabort("%s:%d: the rate must be positive\n", traffic, lineno);
+            }
+         for (f = 0; f < FLOWS; f++)
+            addconn(src, dst, rate, 0.0);
+         }
+      fclose(fp);
+      }
+   for (connbytes = 0; (nflow - 1) >> 8*connbytes; connbytes++)
+      ;
+   for (nsources = 0, i = 0; i < 2*nflow; i++)
+      if (port[i].rate > 0) {
+         sources[nsources] = i;
+         ratesum[nsources] = port[i].rate + (nsources > 0 ? ratesum[nsources-1] : 0.0);
+         nsources++;
+         }
+   if (nsources == 0) {
+      simabort("No entity sends any messages\n");
+      }
+}
+
+/* the endpoint at entity to of connection c, whose other end is entity */
+/* from; -1 if there is none, when a corrupted header named c           */
+int flowlookup(int c, int to, int from)
+{
+   if (c < 0 || c >= nflow)
+      return -1;
+   if (flowtab[c].end[1] == to && flowtab[c].end[0] == from)
+      return 2*c + 1;
+   if (flowtab[c].end[0] == to && flowtab[c].end[1] == from)
+      return 2*c;
+   return -1;
+}
+
+/* a new slot at the tail of the messages for endpoint h to send.  The */
+/* delivered ones are moved out once they fill half the slots.         */
+struct pending *pendnew(struct port *h)
+{
+   if (h->pendtail == h->pendmax) {
+      if (h->pendhead > 0 && h->pendhead >= h->pendmax/2) {
+         memmove(h->pending, h->pending + h->pendhead,
+                 (h->pendtail - h->pendhead)*sizeof(struct pending));
+         h->pendtail -= h->pendhead;
+         h->pendgive -= h->pendhead;
+         h->pendhead = 0;
+         }
+       else {
+         h->pendmax = h->pendmax ? 2*h->pendmax : 64;
+         h->pending = (struct pending *)realloc(h->pending, h->pendmax*sizeof(struct pending));
+         }
+      }
+   return &h->pending[h->pendtail++];
+}
+
+/* the name of entity e in messages: A and B, then numbers */
+char *entname(int e)
+{
+   static SIMSTATE char name[4][16];
+   static SIMSTATE int next = 0;
+
+   if (e == A)
+      return "A";
+   if (e == B)
+      return "B";
+   next = (next + 1) % 4;            /* a few may be in one printf */
+   snprintf(name[next], sizeof(name[next]), "%d", e);
+   return name[next];
+}
+
+/* the name of endpoint e in messages: that of its entity while there */
+/* is one connection, else with the connection's number, as in A.12   */
+char *epname(int e)
+{
+   static SIMSTATE char name[4][32];
+   static SIMSTATE int next = 0;
+   char *ent = entname(flowtab[e >> 1].end[e & 1]);
+
+   if (nflow == 1)
+      return ent;
+   next = (next + 1) % 4;
+   snprintf(name[next], sizeof(name[next]), "%s.%d", ent, e >> 1);
+   return name[next];
+}
+
+/* start the protocol at both ends of every connection, after siminit() */
+void initendpoints()
+{
+   int i;
+
+   for (i = 0; i < 2*nflow; i++)
+      ep_init(i, i >> 1);
+}
+
+
+/* take an event from the pool, growing the pool by a chunk when empty */
+struct event *newevent()
+{
+   struct event *p;
+   int i;
+
+   if (evfree == NULL) {
+      p = (struct event *)malloc(EVPOOL_CHUNK*sizeof(struct event));
+      if (p == NULL) {
+         printf("INTERNAL PANIC: out of memory for events\n");
+         exit(1);
+         }
+      evchunks++;
+      for (i = 0; i < EVPOOL_CHUNK; i++) {
+         p[i].next = evfree;
+         evfree = &p[i];
+         }
+      }
+   p = evfree;
+   evfree = p->next;
+   p->wirelen = 0;
+   p->payload = NULL;
+   evallocs++;
+   if (++evinuse > evpeak)
+      evpeak = evinuse;
+   return p;
+}
+
+/* give an event back to the pool, with its reference to a payload */
+void freeevent(struct event *p)
+{
+   pktbuf_release(p->payload);
+   p->next = evfree;
+   evfree = p;
+   evinuse--;
+}
+
+/* a payload buffer with one reference, growing the pool when empty */
+char *pktbuf_alloc()
+{
+   struct pbchunk *c;
+   struct pktbuf *b;
+   int i;
+
+   if (pbfree == NULL) {
+      c = (struct pbchunk *)malloc(sizeof(struct pbchunk));
+      if (c == NULL) {
+         printf("INTERNAL PANIC: out of memory for packet payloads\n");
+         exit(1);
+         }
+      pbchunks++;
+      c->next = pbchunklist;
+      pbchunklist = c;
+      for (i = 0; i < PKTBUF_CHUNK; i++) {
+         c->buf[i].next = pbfree;
+         pbfree = &c->buf[i];
+         }
+      }
+   b = pbfree;
+   pbfree = b->next;
+   b->refs = 1;
+   pballocs++;
+   if (++pbinuse > pbpeak)
+      pbpeak = pbinuse;
+   return b->data;
+}
+
+struct pktbuf *pktbuf_of(char *payload)
+{
+   return (struct pktbuf *)(payload - offsetof(struct pktbuf, data));
+}
+
+void pktbuf_hold(char *payload)
+{
+   if (payload != NULL)
+      pktbuf_of(payload)->refs++;
+}
+
+/* drop a reference (none for NULL); the last one frees the buffer */
+void pktbuf_release(char *payload)
+{
+   struct pktbuf *b;
+
+   if (payload == NULL)
+      return;
+   b = pktbuf_of(payload);
+   if (b->refs <= 0) {
+      simabort("INTERNAL PANIC: payload released more often than held\n");
+      }
+   if (--b->refs == 0) {
+      b->next = pbfree;
+      pbfree = b;
+      pbinuse--;
+      }
+}
+
+/* every buffer back to the pool, whoever still held it (a new run) */
+void pktbuf_reset()
+{
+   struct pbchunk *c;
+   int i;
+
+   pbfree = NULL;
+   for (c = pbchunklist; c != NULL; c = c->next)
+      for (i = 0; i < PKTBUF_CHUNK; i++) {
+         c->buf[i].refs = 0;
+         c->buf[i].next = pbfree;
+         pbfree = &c->buf[i];
+         }
+   pballocs = 0;
+   pbinuse = 0;
+   pbpeak = 0;
+}
+
+/* copy n payload bytes: the only way payload bytes are copied, so that */
+/* the statistics can count the copies                                  */
+void pktcopy(char *to, const char *from, int n)
+{
+   memcpy(to, from, n);
+   stats.copies++;
+   stats.copybytes += n;
+}
+
+/* p is due before q: earlier time first, and on equal times the more */
+/* recently inserted event first (the order the list walk has always used) */
+int evbefore(struct event *p, struct event *q)
+{
+   if (p->evtime != q->evtime)
+      return p->evtime < q->evtime;
+   return p->evseq > q->evseq;
+}
+
+void evheapset(int i, struct event *p)
+{
+   evheap[i] = p;
+   p->heapidx = i;
+}
+
+void evsiftup(int i)
+{
+   struct event *p = evheap[i];
+
+   while (i > 0 && evbefore(p, evheap[(i-1)/2])) {
+      evheapset(i, evheap[(i-1)/2]);
+      i = (i-1)/2;
+      }
+   evheapset(i, p);
+}
+
+void evsiftdown(int i)
+{
+   struct event *p = evheap[i];
+   int c;
+
+   while ((c = 2*i + 1) < evheapsize) {
+      if (c+1 < evheapsize && evbefore(evheap[c+1], evheap[c]))
+         c++;
+      if (!evbefore(evheap[c], p))
+         break;
+      evheapset(i, evheap[c]);
+      i = c;
+      }
+   evheapset(i, p);
+}
+
+void insertevent(struct event *p)
+{
+   if (TRACING(3)) {
+      printf("            INSERTEVENT: time is %lf\n",simtime);
+      printf("            INSERTEVENT: future time will be %lf\n",p->evtime);
+      }
+   p->evseq = evcount++;
+   p->evslot = NULL;
+   if (TIMERQ == TIMERQ_WHEEL && p->evtype == TIMER_INTERRUPT && wheelinsert(p))
+      return;
+   evheapinsert(p);
+}
+
+/* put p on the event queue, keeping its evseq */
+void evheapinsert(struct event *p)
+{
+   struct event *q,*qold;
+
+   if (EVQUEUE == EVQUEUE_HEAP) {
+      evheapops++;
+      if (evheapsize == evheapmax) {
+         evheapmax = evheapmax ? 2*evheapmax : 64;
+         evheap = (struct event **)realloc(evheap, evheapmax*sizeof(struct event *));
+         }
+      evheapset(evheapsize, p);
+      evsiftup(evheapsize++);
+      return;
+      }
+   q = evlist;     /* q points to header of list in which p struct inserted */
+   if (q==NULL) {   /* list is empty */
+        evlist=p;
+        p->next=NULL;
+        p->prev=NULL;
+        }
+     else {
+        for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
+              qold=q;
+        if (q==NULL) {   /* end of list */
+             qold->next = p;
+             p->prev = qold;
+             p->next = NULL;
+             }
+           else if (q==evlist) { /* front of list */
+             p->next=evlist;
+             p->prev=NULL;
+             p->next->prev=p;
+             evlist = p;
+             }
+           else {     /* middle of list */
+             p->next=q;
+             p->prev=q->prev;
+             q->prev->next=p;
+             q->prev=p;
+             }
+         }
+}
+
+/* take the earliest event off the event queue, NULL if it is empty */
+struct event *nextevent()
+{
+   struct event *p;
+
+   if (EVQUEUE == EVQUEUE_HEAP) {
+      if (TIMERQ == TIMERQ_WHEEL)
+         wheeldue();
+      p = evheapsize > 0 ? evheap[0] : NULL;
+      }
+    else
+      p = evlist;
+   if (p != NULL)
+      removeevent(p);
+   return p;
+}
+
+/* unlink a pending event from the event queue (the caller frees it) */
+void removeevent(struct event *q)
+{
+   struct event *last;
+   int i;
+
+   evremoves++;
+   if (TIMERQ == TIMERQ_WHEEL && q->evslot != NULL) {
+      wheelunlink(q);
+      return;
+      }
+   if (EVQUEUE == EVQUEUE_HEAP) {
+      evheapops++;
+      i = q->heapidx;
+      last = evheap[--evheapsize];
+      if (last != q) {            /* refill the hole with the last leaf */
+         evheapset(i, last);
+         evsiftup(i);
+         evsiftdown(last->heapidx);
+         }
+      q->heapidx = -1;
+      return;
+      }
+   if (q->next==NULL && q->prev==NULL)
+         evlist=NULL;         /* remove first and only event on list */
+      else if (q->next==NULL) /* end of list - there is one in front */
+         q->prev->next = NULL;
+      else if (q==evlist) { /* front of list - there must be event after */
+         q->next->prev=NULL;
+         evlist = q->next;
+         }
+       else {     /* middle of list */
+         q->next->prev = q->prev;
+         q->prev->next =  q->next;
+         }
+}
+
+/* TIMERQ_WHEEL: put timer p in the slot of its tick, 0 if it goes on */
+/* the heap instead: its tick is due already or beyond level 1        */
+int wheelinsert(struct event *p)
+{
+   long t, block;
+   int level;
+
+   if (p->evtime >= (double)((wheeltick >> WHEEL_BITS) + WHEEL_SLOTS) * WHEEL_SLOTS * WHEEL_TICK)
+      return 0;
+   t = (long)(p->evtime / WHEEL_TICK);
+   block = t >> WHEEL_BITS;
+   if (t < wheeltick)
+      return 0;
+   level = block != wheeltick >> WHEEL_BITS;
+   p->evslot = &wheel[level][(level ? block : t) & (WHEEL_SLOTS-1)];
+   p->prev = NULL;
+   p->next = *p->evslot;
+   if (p->next != NULL)
+      p->next->prev = p;
+   *p->evslot = p;
+   wheeln[level]++;
+   return 1;
+}
+
+void wheelunlink(struct event *p)
+{
+   if (p->prev != NULL)
+      p->prev->next = p->next;
+    else
+      *p->evslot = p->next;
+   if (p->next != NULL)
+      p->next->prev = p->prev;
+   wheeln[p->evslot >= wheel[1]]--;
+   p->evslot = NULL;
+}
+
+/* TIMERQ_WHEEL: before the earliest event on the heap is taken, put */
+/* every timer that might go off no later on the heap too, a tick at */
+/* a time (when the heap is empty, up to the first tick with one).   */
+/* Entering a new block of WHEEL_SLOTS ticks brings its level 1 slot */
+/* down to level 0.                                                  */
+void wheeldue()
+{
+   struct event *p, **slot;
+   long next;
+
+   while (wheeln[0] + wheeln[1] > 0
+          && (evheapsize == 0 || wheeltick*WHEEL_TICK <= evheap[0]->evtime)) {
+      if (wheeln[0] == 0) {          /* skip the empty ticks of this block */
+         next = (wheeltick | (WHEEL_SLOTS-1)) + 1;
+         if (evheapsize > 0 && evheap[0]->evtime / WHEEL_TICK + 1 < next)
+            next = (long)(evheap[0]->evtime / WHEEL_TICK) + 1;
+         wheeltick = next - 1;
+         }
+      slot = &wheel[0][wheeltick & (WHEEL_SLOTS-1)];
+      while ((p = *slot) != NULL) {
+         wheelunlink(p);
+         evheapinsert(p);
+         }
+      if ((++wheeltick & (WHEEL_SLOTS-1)) == 0) {
+         slot = &wheel[1][(wheeltick >> WHEEL_BITS) & (WHEEL_SLOTS-1)];
+         while ((p = *slot) != NULL) {
+            wheelunlink(p);
+            wheelinsert(p);
+            }
+         }
+      }
+}
+
+void printevlist()
+{
+  struct event *q;
+  int i;
+  printf("--------------\nEvent List Follows:\n");
+  for (i = 0; i < evheapsize; i++) {      /* heap order, not time order */
+    q = evheap[i];
+    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+    }
   for(q = evlist; q!=NULL; q=q->next) {
     printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
     }
+  for (i = 0; i < 2*WHEEL_SLOTS; i++)    /* timers still on the wheel */
+    for (q = wheel[i / WHEEL_SLOTS][i % WHEEL_SLOTS]; q != NULL; q = q->next)
+      printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
   printf("--------------\n");
 }
 
+/* wall clock in seconds, for the benchmarks */
+double wallclock()
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+/* hold-model benchmark of the event queue: keep n events pending, then */
+/* repeatedly take the earliest one off and schedule it again later     */
+void evqbench()
+{
+   static int sizes[] = { 16, 64, 256, 1024, 4096, 16384 };
+   struct event *p;
+   double start, secs;
+   long k, ops;
+   int i, n;
+
+   printf("%-8s %-6s %14s\n", "queued", "queue", "events/sec");
+   for (i = 0; i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++) {
+      n = sizes[i];
+      rnginit(9999);
+      simtime = 0.0;
+      for (k = 0; k < n; k++) {
+         p = newevent();
+         p->evtime = 10*jimsrand();
+         p->evtype = FROM_LAYER3;
+         p->eventity = k % 2;
+         insertevent(p);
+         }
+      ops = EVQUEUE == EVQUEUE_HEAP ? 2000000 : 20000000 / n;
+      start = wallclock();
+      for (k = 0; k < ops; k++) {
+         p = nextevent();
+         simtime = p->evtime;
+         p->evtime = simtime + 10*jimsrand();
+         insertevent(p);
+         }
+      secs = wallclock() - start;
+      printf("%-8d %-6s %14.0f\n", n, EVQUEUE == EVQUEUE_HEAP ? "heap" : "list",
+             secs > 0 ? ops/secs : 0.0);
+      while ((p = nextevent()) != NULL)
+         freeevent(p);
+      }
+}
+
+/* the checksum the protocols used before the word-wise one, for cksumbench */
+int bytesum_check_sum(struct pkt packet)
+{
+	int sum = 0, i = 0;
+	sum = packet.checksum;
+	sum += packet.seqnum;
+	sum += packet.acknum;
+	sum += packet.isACK;
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	for (i = 0; i < 20; i += 2) {
+		sum += (packet.payload[i] << 8) + packet.payload[i+1];
+		sum = (sum >> 16) + (sum & 0xffff);
+	}
+	sum = (~sum) & 0xffff;
+	return sum;
+}
+
+/* the same sum one big-endian 16-bit word at a time, to check cksum_add */
+unsigned cksum_ref(const unsigned char *p, int len)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i+1];
+	if (i < len)
+		sum += p[i] << 8;
+	return cksum_fold(sum);
+}
+
+/* checksum benchmark: the old and the word-wise packet checksum, patching */
+/* an ACK's checksum for a new acknum, and cksum_add over longer buffers   */
+void cksumbench()
+{
+	static int sizes[] = { 20, 21, 64, 576, 1500, 9000, 65535 };
+	struct pkt *pkts;
+	unsigned char *buf;
+	double start, secs;
+	long k, ops, bad;
+	int i, j, n = 1024;
+	volatile int sink = 0;
+
+	rnginit(9999);
+	pkts = (struct pkt *)calloc(n, sizeof(struct pkt));
+	for (i = 0; i < n; i++) {
+		pkts[i].seqnum = 1000*jimsrand();
+		pkts[i].acknum = 1000*jimsrand();
+		pkts[i].isACK = jimsrand() < 0.5;
+		pkts[i].checksum = 0;
+		pkts[i].length = 20;
+		pkts[i].more = 0;
+		pkts[i].payload = (char *)malloc(20);
+		for (j = 0; j < 20; j++)
+			pkts[i].payload[j] = 256*jimsrand();   /* high bytes too */
+		}
+	ops = 20000000;
+	printf("%-24s %14s\n", "packet checksum", "packets/sec");
+	start = wallclock();
+	for (k = 0; k < ops; k++)
+		sink += bytesum_check_sum(pkts[k & (n-1)]);
+	secs = wallclock() - start;
+	printf("%-24s %14.0f\n", "16-bit, by value", secs > 0 ? ops/secs : 0.0);
+	start = wallclock();
+	for (k = 0; k < ops; k++)
+		sink += compute_check_sum(&pkts[k & (n-1)]);
+	secs = wallclock() - start;
+	printf("%-24s %14.0f\n", "word-wise", secs > 0 ? ops/secs : 0.0);
+	start = wallclock();
+	for (k = 0; k < ops; k++)
+		sink += cksum_update(sink & 0xffff, k, k+1);
+	secs = wallclock() - start;
+	printf("%-24s %14.0f\n", "incremental (RFC 1624)", secs > 0 ? ops/secs : 0.0);
+
+	/* an ACK patched for its acknum has the checksum a full sum gives */
+	for (bad = 0, k = -1; k < 1000000; k++) {
+		struct pkt ackpkt = make_ack(k & 1023, k);
+		ackpkt.checksum = 0;
+		bad += compute_check_sum(&ackpkt) != make_ack(k & 1023, k).checksum;
+		}
+	printf("incremental mismatches   %ld of 1000001 ACKs\n\n", bad);
+
+	printf("%-8s %14s %14s  %s\n", "bytes", "16-bit MB/s", "word MB/s", "sums");
+	buf = (unsigned char *)malloc(sizes[sizeof(sizes)/sizeof(sizes[0]) - 1] + 8);
+	for (i = 0; i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++) {
+		double ref, word;
+		for (j = 0; j < sizes[i] + 8; j++)
+			buf[j] = 256*jimsrand();
+		ops = 200000000 / (sizes[i] + 16);
+		start = wallclock();
+		for (k = 0; k < ops; k++)
+			sink += cksum_ref(buf + (k & 7), sizes[i]);
+		secs = wallclock() - start;
+		ref = secs > 0 ? ops*(double)sizes[i]/secs/1e6 : 0.0;
+		start = wallclock();
+		for (k = 0; k < ops; k++)
+			sink += cksum_add(buf + (k & 7), sizes[i]);
+		secs = wallclock() - start;
+		word = secs > 0 ? ops*(double)sizes[i]/secs/1e6 : 0.0;
+		for (bad = 0, j = 0; j < 8; j++)
+			bad += cksum_ref(buf + j, sizes[i]) != cksum_add(buf + j, sizes[i]);
+		printf("%-8d %14.1f %14.1f  %s\n", sizes[i], ref, word, bad ? "DIFFER" : "agree");
+		}
+	free(buf);
+	free(pkts);
+}
+
+
+/* what -tracefile costs: the same lossy reno run untraced, writing its */
+/* records to /dev/null (building them, without the file system) and to */
+/* a file.  The three take turns and each shows its best of five runs;  */
+/* overhead is the extra time over the untraced run.  Building the      */
+/* records stays within 10%; writing the 100 MB they make costs more    */
+/* than that, so a run traced to a file misses the 10% goal.            */
+#define  TRACE_BENCHFILE "tracebench.tmp"
+
+void tracebench()
+{
+   static char *files[] = { NULL, "/dev/null", TRACE_BENCHFILE };
+   static char *what[] = { "off", "/dev/null", "file" };
+   double start, secs, best[3];
+   long records = 0;
+   int i, r;
+
+   for (r = 0; r < 5; r++)
+      for (i = 0; i < 3; i++) {
+         NENTITY = 2;
+         FLOWS = 1;
+         traffic = NULL;
+         BIDIRECTIONAL = 1;
+         TRACE = 0;
+         nsimmax = 300000;
+         lossprob = 0.1;
+         corruptprob = 0.1;
+         lambda = 20.0;
+         TIME_OUT = 24.0;
+         ADAPTIVE_RTO = 0;
+         CONGESTION = (PROTOCOL == PROTO_SW) ? CC_FIXED : CC_RENO;
+         siminit();
+         if (files[i] != NULL)
+            traceopen(files[i]);
+         initendpoints();
+         start = wallclock();
+         simulate();
+         if (files[i] != NULL)
+            records = tracewritten + tracenrec;
+         traceclose();
+         secs = wallclock() - start;
+         if (r == 0 || secs < best[i])
+            best[i] = secs;
+         }
+   printf("%-10s %10s %10s %12s %10s %10s\n", "trace", "messages", "seconds", "records",
+          "MB", "overhead");
+   for (i = 0; i < 3; i++)
+      printf("%-10s %10d %10.3f %12ld %10.1f %9.0f%%\n", what[i], nsim, best[i],
+             files[i] != NULL ? records : 0L,
+             files[i] != NULL ? records*sizeof(struct tracerec)/1e6 : 0.0,
+             best[0] > 0 ? 100.0*(best[i] - best[0])/best[0] : 0.0);
+   remove(TRACE_BENCHFILE);
+}
+
+/* the whole simulation as the network grows: pairs of endpoints sending */
+/* both ways, each one getting a message every 50 time units, which the */
+/* uniform link carries with its ACKs.  The work per event shouldn't    */
+/* grow with the endpoints, only the event queue does.  timer ops is   */
+/* the share of event queue inserts and removes that start, stop or    */
+/* fire a timer: all a timing wheel (-DTIMERQ=TIMERQ_WHEEL) could take  */
+/* off the heap.  heap ops is the inserts and removes per event that    */
+/* reached the heap, 2 without the wheel.                               */
+void entitybench()
+{
+   static int sizes[] = { 2, 10, 100, 1000, 10000 };
+   double start, secs;
+   int i;
+
+   printf("%-10s %10s %12s %10s %14s %10s %10s %10s  %s\n", "endpoints", "messages", "events",
+          "peak queue", "events/sec", "delivered", "timer ops", "heap ops", "timers");
+   for (i = 0; i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++) {
+      NENTITY = sizes[i];
+      FLOWS = 1;
+      traffic = NULL;
+      BIDIRECTIONAL = 1;
+      TRACE = 0;
+      nsimmax = 200000;
+      lossprob = 0.0;
+      corruptprob = 0.0;
+      lambda = 50.0 / NENTITY;
+      siminit();
+      initendpoints();
+      start = wallclock();
+      simulate();
+      secs = wallclock() - start;
+      printf("%-10d %10d %12lu %10d %14.0f %10d %9.1f%% %10.2f  %s\n", NENTITY, nsim, evcount,
+             evpeak, secs > 0 ? evcount/secs : 0.0, stats.delivered,
+             100.0*evtimerops/(evcount + evremoves), (double)evheapops/evcount,
+             TIMERQ == TIMERQ_WHEEL ? "wheel" : "heap");
+      }
+}
+
+/* throughput under a sustained backlog: messages come faster than the */
+/* uniform link carries them at the smaller lambdas, so the sender      */
+/* buffers stay full and what counts is how fast queued packets go out */
+/* as the window opens, with each congestion control                    */
+void backlogbench()
+{
+   static float lambdas[] = { 2, 5, 10, 20 };
+   static float losses[] = { 0.0, 0.1 };
+   int c, i, j;
+
+   printf("%-10s %-6s %8s %6s %10s %10s %14s\n", "protocol", "cc", "lambda", "loss",
+          "messages", "delivered", "per time unit");
+   for (c = 0; ccname[c] != NULL; c++) {
+      if (PROTOCOL == PROTO_SW && c != CC_FIXED)
+         continue;               /* stop-and-wait has no congestion window */
+      for (i = 0; i < (int)(sizeof(lambdas)/sizeof(lambdas[0])); i++)
+         for (j = 0; j < (int)(sizeof(losses)/sizeof(losses[0])); j++) {
+            NENTITY = 2;
+            FLOWS = 1;
+            traffic = NULL;
+            BIDIRECTIONAL = 1;
+            TRACE = 0;
+            nsimmax = 5000;
+            lossprob = losses[j];
+            corruptprob = 0.0;
+            lambda = lambdas[i];
+            ADAPTIVE_RTO = 0;
+            TIME_OUT = 30.0;
+            CONGESTION = c;
+            siminit();
+            initendpoints();
+            simulate();
+            printf("%-10s %-6s %8g %6g %10d %10d %14f\n", protoname[PROTOCOL], ccname[c],
+                   lambda, lossprob, nsim, stats.delivered,
+                   simtime > 0 ? stats.delivered/simtime : 0.0);
+            }
+      }
+}
+
+/* long-run check of the simulation clock: a run that takes the clock   */
+/* past 10^7 time units, where a float clock can no longer tell events */
+/* a fraction of a unit apart.  Every event must come at a later time  */
+/* than the one before it: an event dated before the clock aborts the  */
+/* run, and one at the same time counts as a tie.  1 if either happens. */
+int clockbench()
+{
+   jmp_buf escape;
+   double start, secs;
+   int backwards;
+
+   NENTITY = 2;
+   FLOWS = 1;
+   traffic = NULL;
+   BIDIRECTIONAL = 1;
+   TRACE = 0;
+   nsimmax = 550000;
+   lossprob = 0.1;
+   corruptprob = 0.0;
+   lambda = 20.0;
+   ADAPTIVE_RTO = 1;
+   TIME_OUT = 24.0;
+   CONGESTION = CC_FIXED;
+   simescape = &escape;
+   start = wallclock();
+   backwards = setjmp(escape);
+   if (!backwards) {
+      siminit();
+      initendpoints();
+      simulate();
+      }
+   secs = wallclock() - start;
+   simescape = NULL;
+   printf("%-12s %10s %12s %10s %8s  %s\n", "clock", "messages", "events", "time", "ties", "check");
+   printf("%-12s %10d %12lu %10.0f %8ld  %s (%.1f s)\n", sizeof(simclock) == sizeof(float) ? "float" : "double",
+          nsim, evcount, (double)simtime, stats.clockties,
+          backwards ? "FAILED, time went backwards" : stats.clockties > 0 ? "FAILED, tied events" :
+          simtime < 1e7 ? "FAILED, too short" : "ok", secs);
+   return backwards || stats.clockties > 0 || simtime < 1e7;
+}
+
+/* demultiplexing as the connections grow: ACKs of n connections between */
+/* A and B arrive in random order, and each is parsed and its endpoint  */
+/* looked up in the flow table.  The cost per packet should stay flat,  */
+/* as the table is indexed by the connection number the header carries. */
+void flowbench()
+{
+   static int sizes[] = { 1, 10, 100, 1000, 10000, 100000 };
+   unsigned char (*hdr)[WIRE_HDR_MAX];
+   int *len, *to, nframes = 1 << 16;
+   struct pkt p;
+   double start, secs;
+   long k, ops = 20000000, bad;
+   int i;
+   volatile int sink = 0;
+
+   hdr = malloc(nframes*sizeof(*hdr));
+   len = (int *)malloc(nframes*sizeof(int));
+   to = (int *)malloc(nframes*sizeof(int));
+   printf("%-10s %8s %14s %10s  %s\n", "flows", "header", "packets/sec", "ns/packet", "lookups");
+   for (i = 0; i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++) {
+      NENTITY = 2;
+      FLOWS = sizes[i];
+      traffic = NULL;
+      BIDIRECTIONAL = 1;
+      rnginit(9999);
+      trafficinit();
+      memset(&p, 0, sizeof(p));
+      p.isACK = 1;
+      for (k = 0; k < nframes; k++) {
+         p.conn = (int)(jimsrand()*nflow) % nflow;
+         p.acknum = (int)(jimsrand()*1000);
+         to[k] = jimsrand() < 0.5 ? A : B;
+         len[k] = pkt_serialize(&p, hdr[k]);
+         }
+      start = wallclock();
+      for (k = 0; k < ops; k++)
+         if (pkt_parse(hdr[k & (nframes-1)], len[k & (nframes-1)], NULL, &p))
+            sink += flowlookup(p.conn, to[k & (nframes-1)], !to[k & (nframes-1)]);
+      secs = wallclock() - start;
+      for (bad = 0, k = 0; k < nframes; k++)
+         bad += !pkt_parse(hdr[k], len[k], NULL, &p) || flowlookup(p.conn, to[k], !to[k]) < 0;
+      printf("%-10d %8d %14.0f %10.1f  %s\n", nflow, WIRE_HDR, secs > 0 ? ops/secs : 0.0,
+             1e9*secs/ops, bad ? "FAILED" : "ok");
+      }
+   free(hdr);
+   free(len);
+   free(to);
+}
 
 
 /********************** Student-callable ROUTINES ***********************/
@@ -666,151 +2533,824 @@ void printevlist()
 /* called by students routine to cancel a previously-started timer */
 void stoptimer(int AorB)
 {
- struct event *q,*qold;
+ struct event *q;
 
- if (TRACE>2)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
- for (q=evlist; q!=NULL ; q = q->next)
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
+ if (TRACING(3))
+    printf("          STOP TIMER: stopping timer at %f\n",simtime);
+ q = port[AorB].timer;
+ if (q != NULL) {
+       if (tracefp != NULL)
+          tracerecord(TR_TIMERSTOP, AorB, NULL, TRO_OK);
        /* remove this event */
-       if (q->next==NULL && q->prev==NULL)
-             evlist=NULL;         /* remove first and only event on list */
-          else if (q->next==NULL) /* end of list - there is one in front */
-             q->prev->next = NULL;
-          else if (q==evlist) { /* front of list - there must be event after */
-             q->next->prev=NULL;
-             evlist = q->next;
-             }
-           else {     /* middle of list */
-             q->next->prev = q->prev;
-             q->prev->next =  q->next;
-             }
-       free(q);
+       removeevent(q);
+       freeevent(q);
+       port[AorB].timer = NULL;
+       evtimerops++;
        return;
      }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
-  exit(1);
+  simabort("Warning: unable to cancel your timer. It wasn't running.\n");
 }
 
 
 void starttimer(int AorB, float increment)
 {
 
- struct event *q;
  struct event *evptr;
 
- if (TRACE>2)
-    printf("          START TIMER: starting timer at %f\n",time);
+ if (TRACING(3))
+    printf("          START TIMER: starting timer at %f\n",simtime);
  /* be nice: check to see if timer is already started, if so, then  warn */
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-   for (q=evlist; q!=NULL ; q = q->next)
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
-      printf("Warning: attempt to start a timer that is already started\n");
-      exit(1);
+   if (timerrunning(AorB)) {
+      simabort("Warning: attempt to start a timer that is already started\n");
       return;
       }
 
 /* create future event for when timer goes off */
-   evptr = (struct event *)malloc(sizeof(struct event));
-   evptr->evtime =  time + increment;
+   evptr = newevent();
+   evptr->evtime =  simtime + increment;
    evptr->evtype =  TIMER_INTERRUPT;
    evptr->eventity = AorB;
    insertevent(evptr);
+   port[AorB].timer = evptr;
+   evtimerops++;
+   if (tracefp != NULL)
+      tracerecord(TR_TIMERSTART, AorB, NULL, TRO_OK);
 }
 
+/* is the timer of endpoint AorB currently running? */
+int timerrunning(int AorB)
+{
+   return port[AorB].timer != NULL;
+}
 
-/************************** TOLAYER3 ***************/
-void tolayer3(int AorB, struct pkt packet)
+
+/************************** WIRE FORMAT ***************/
+
+/* n bytes of v, most significant first */
+void putfield(unsigned char *p, unsigned v, int n)
 {
- struct pkt *mypktptr;
- struct event *evptr,*q;
- float lastime, x;
- int i;
+   while (n-- > 0) {
+      p[n] = v & 0xff;
+      v >>= 8;
+      }
+}
 
+unsigned getfield(unsigned char *p, int n)
+{
+   unsigned v = 0;
 
- ntolayer3++;
+   while (n-- > 0)
+      v = v << 8 | *p++;
+   return v;
+}
 
- /* simulate losses: */
- if (jimsrand() < lossprob)  {
-      nlost++;
-      if (TRACE>0) {
-        printf(RED);
-        printf("          TOLAYER3: packet being lost\n");
-        printf(RESET);
+/* pack the header of a packet into hdr, return the length of the frame: */
+/* the header and the payload, which stays in its buffer behind it.       */
+/* A field the format can't carry is an error in the protocol.  A NAK has   */
+/* 1 in the ack field: the checksum can't tell acknum -1 from 0 (both add  */
+/* nothing in one's complement), so with 0 there one flipped flag bit would */
+/* turn a good ACK for 0 into a NAK the receiver can't tell was corrupted.  */
+int pkt_serialize(struct pkt *packet, unsigned char *hdr)
+{
+   unsigned seqmax = 0xffffffffu >> (32 - SEQBITS);
+   int nak = packet->isACK == 1 && packet->acknum == -1;
+
+   if ((unsigned)packet->seqnum > seqmax || (!nak && (unsigned)packet->acknum > seqmax)
+       || (packet->isACK & ~1) || (packet->more & ~1) || (packet->checksum & ~0xffff)) {
+      simabort("TOLAYER3: seq %d, ack %d, isACK %d, more %d, checksum %d don't fit the wire (seqbits %d)\n",
+               packet->seqnum, packet->acknum, packet->isACK, packet->more, packet->checksum, SEQBITS);
       }
+   putfield(hdr, packet->conn, CONN_BYTES);
+   hdr += CONN_BYTES;
+   putfield(hdr, packet->seqnum, SEQ_BYTES);
+   putfield(hdr + SEQ_BYTES, nak ? 1 : packet->acknum, SEQ_BYTES);
+   hdr[2*SEQ_BYTES] = (packet->isACK ? WF_ACK : 0) | (nak ? WF_NAK : 0) | (packet->more ? WF_MORE : 0);
+   putfield(hdr + 2*SEQ_BYTES + 1, packet->checksum, 2);
+   return WIRE_HDR + packet->length;
+}
 
+/* unpack a frame of len bytes, header hdr and payload, into *packet,    */
+/* which borrows the payload for the call it is passed to; 0 if          */
+/* pkt_serialize() can't have written it, which only happens when the    */
+/* medium corrupted it                                                   */
+int pkt_parse(unsigned char *hdr, int len, char *payload, struct pkt *packet)
+{
+   unsigned seqmax = 0xffffffffu >> (32 - SEQBITS), seq, ack;
+   int flags;
+
+   if (len < WIRE_HDR || len > WIRE_HDR + MSS_MAX)
+      return 0;
+   packet->conn = getfield(hdr, CONN_BYTES);
+   hdr += CONN_BYTES;
+   seq = getfield(hdr, SEQ_BYTES);
+   ack = getfield(hdr + SEQ_BYTES, SEQ_BYTES);
+   flags = hdr[2*SEQ_BYTES];
+   if (seq > seqmax || ack > seqmax || (flags & ~(WF_ACK | WF_NAK | WF_MORE))
+       || ((flags & WF_NAK) && (!(flags & WF_ACK) || ack != 1)))
+      return 0;
+   packet->seqnum = seq;
+   packet->acknum = flags & WF_NAK ? -1 : (int)ack;
+   packet->isACK = (flags & WF_ACK) != 0;
+   packet->more = (flags & WF_MORE) != 0;
+   packet->checksum = getfield(hdr + 2*SEQ_BYTES + 1, 2);
+   packet->length = len - WIRE_HDR;
+   packet->payload = packet->length > 0 ? payload : NULL;
+   return 1;
+}
+
+
+/************************** TOLAYER3 ***************/
+void tolayer3(int AorB, struct pkt packet)
+{
+ struct event *evptr;
+ struct channel *chan;
+ struct link *lk;
+ struct event *h;
+ simclock lastime;
+ float loss, ser;
+ int i, from, to, dir;
+
+ if (packet.conn != AorB >> 1) {
+    simabort("TOLAYER3: %s sent a packet of connection %d, it is on %d\n", epname(AorB),
+             packet.conn, AorB >> 1);
+    }
+ from = flowtab[AorB >> 1].end[AorB & 1];
+ to = flowtab[AorB >> 1].end[!(AorB & 1)];
+ dir = to & 1;                    /* RNG streams and link of the direction */
+ if (packet.length < 0 || packet.length > MSS_MAX) {
+    simabort("TOLAYER3: packet length %d is not in 0..%d\n", packet.length, MSS_MAX);
+    }
+ if (packet.length > 0 && packet.payload == NULL) {
+    simabort("TOLAYER3: packet of %d bytes without a payload buffer\n", packet.length);
+    }
+ ntolayer3++;
+ host[from].lastactivity = simtime;
+ chan = &host[to].chan;
+ lk = &linkcfg[dir];
+
+/* pack the header student just gave me into a frame of my own, since */
+/* he/she may do something with the packet after we return to him/her; */
+/* the payload isn't copied, the frame holds a reference to its buffer */
+ evptr = newevent();
+ evptr->wirelen = pkt_serialize(&packet, evptr->hdr);
+ if (packet.length > 0) {
+    evptr->payload = packet.payload;
+    pktbuf_hold(evptr->payload);
+    }
+ if (!duplicating) {
+    stats.wirebytes += evptr->wirelen;
+    stats.hdrbytes += WIRE_HDR;
+    }
+ if (TRACING(3))
+   printf("          TOLAYER3: seq: %d, ack %d, check: %d, %d bytes %.*s\n", packet.seqnum,
+	  packet.acknum, packet.checksum, evptr->wirelen, packet.length,
+	  packet.length ? packet.payload : "");
+
+ /* a full router queue drops the packet (tail drop) */
+ ser = lk->bandwidth > 0 ? evptr->wirelen/lk->bandwidth : 0;
+ if (lk->model == LINK_QUEUE && lk->queuemax > 0 && ser > 0
+     && chan->busy - simtime > (lk->queuemax - 0.999)*ser) {
+      nlost++;
+      stats.queuedrops++;
+      tracef(1, RED "          TOLAYER3: router queue full, packet dropped\n" RESET);
+      if (tracefp != NULL)
+         tracerecord(TR_SEND, AorB, &packet, TRO_QUEUEDROP);
+      freeevent(evptr);
       return;
     }
 
-/* make a copy of the packet student just gave me since he/she may decide */
-/* to do something with the packet after we return back to him/her */
- mypktptr = (struct pkt *)malloc(sizeof(struct pkt));
- mypktptr->seqnum = packet.seqnum;
- mypktptr->acknum = packet.acknum;
- mypktptr->checksum = packet.checksum;
- mypktptr->isACK = packet.isACK;
-
- for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
- if (TRACE>2)  {
-   printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
-	  mypktptr->acknum,  mypktptr->checksum);
-    for (i=0; i<20; i++)
-        printf("%c",mypktptr->payload[i]);
-    printf("\n");
-   }
+ /* simulate losses, in bursts with the Gilbert-Elliott model: */
+ loss = lk->loss >= 0 ? lk->loss : lossprob;
+ if (lk->gebad > 0) {
+    if (rnd(RNG_BURST + dir) < (chan->bad ? lk->gegood : lk->gebad))
+       chan->bad = !chan->bad;
+    if (chan->bad)
+       loss = lk->badloss;
+    }
+ if (rnd(RNG_LOSS + dir) < loss)  {
+      nlost++;
+      if (chan->bad)
+         stats.badlost++;
+      tracef(1, RED "          TOLAYER3: packet being lost\n" RESET);
+      if (tracefp != NULL)
+         tracerecord(TR_SEND, AorB, &packet, TRO_LOST);
+      freeevent(evptr);
+      return;
+    }
 
 /* create future event for arrival of packet at the other side */
-  evptr = (struct event *)malloc(sizeof(struct event));
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
-  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
-  evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
+  evptr->eventity = to;           /* event occurs at the receiving entity */
+  evptr->evsrc = from;
 /* finally, compute the arrival time of packet at the other end.
    medium can not reorder, so make sure packet arrives between 1 and 10
    time units after the latest arrival time of packets
-   currently in the medium on their way to the destination */
- lastime = time;
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
- for (q=evlist; q!=NULL ; q = q->next)
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) )
-      lastime = q->evtime;
- evptr->evtime =  lastime + 1 + 9*jimsrand();
+   currently in the medium on their way to the destination.
+   With LINK_QUEUE it waits for the packets queued ahead of it, takes
+   its serialization time, then the propagation delay. */
+ if (lk->model == LINK_QUEUE) {
+    chan->busy = (chan->busy > simtime ? chan->busy : simtime) + ser;
+    evptr->evtime = chan->busy + lk->delay;
+    }
+  else {
+    lastime = chan->inflight > 0 ? chan->tail : simtime;
+    if (lastime < simtime)          /* only held back packets in flight */
+       lastime = simtime;
+    evptr->evtime =  lastime + 1 + 9*rnd(RNG_DELAY + dir);
+    }
+ chan->tail = evptr->evtime;     /* held back or not, it takes its place in the medium */
+ if (lk->reorder > 0) {
+    /* packets held back that this one was the last to overtake now */
+    /* arrive right behind it                                       */
+    for (i = 0; i < chan->nheld; )
+       if (--chan->heldleft[i] == 0) {
+          h = chan->held[i];
+          removeevent(h);
+          h->evtime = evptr->evtime + 0.001;
+          insertevent(h);
+          chan->held[i] = chan->held[--chan->nheld];
+          chan->heldleft[i] = chan->heldleft[chan->nheld];
+          }
+        else
+          i++;
+    /* hold this one back, out of the FIFO order: it arrives behind the */
+    /* next 1..reorderdepth packets, or after the longest they could    */
+    /* take if the sender doesn't send that many                        */
+    if (chan->nheld < REORDER_HELD && rnd(RNG_REORDER + dir) < lk->reorder) {
+       stats.reordered++;
+       chan->held[chan->nheld] = evptr;
+       chan->heldleft[chan->nheld++] = 1 + (int)(rnd(RNG_REORDER + dir)*lk->reorderdepth);
+       evptr->evtime += 10*lk->reorderdepth;
+       tracef(1, YEL "          TOLAYER3: packet held back\n" RESET);
+       }
+    }
+ chan->inflight++;
 
 
 
  /* simulate corruption: */
- if (jimsrand() < corruptprob)  {
+ if (rnd(RNG_CORRUPT + dir) < corruptprob)  {
     ncorrupt++;
-    if ( (x = jimsrand()) < .75)
-       mypktptr->payload[0]='Z';   /* corrupt payload */
-      else if (x < .875)
-       mypktptr->seqnum = 999999;
-      else if (x < .925)
-          mypktptr->isACK = 999999;
-      else
-       mypktptr->acknum = 999999;
-    if (TRACE>0){
-        printf(RED);
-        printf("          TOLAYER3: packet being corrupted\n");
-        printf(RESET);
-    }
+    i = (int)(rnd(RNG_CORRUPT + dir) * 8 * evptr->wirelen);
+    if (i/8 < WIRE_HDR)
+       evptr->hdr[i/8] ^= 1 << (i%8);     /* flip a bit of the header */
+     else {
+       /* or of the payload.  The sender still holds the buffer for */
+       /* resending it, so the frame gets a copy of its own first   */
+       if (pktbuf_of(evptr->payload)->refs > 1) {
+          char *copy = pktbuf_alloc();
+          pktcopy(copy, evptr->payload, packet.length);
+          pktbuf_release(evptr->payload);
+          evptr->payload = copy;
+          }
+       i -= 8*WIRE_HDR;
+       evptr->payload[i/8] ^= 1 << (i%8);
+       }
+    tracef(1, RED "          TOLAYER3: packet being corrupted\n" RESET);
+    if (tracefp != NULL)
+       tracerecord(TR_SEND, AorB, &packet, TRO_CORRUPT);
 
     }
 
-  if (TRACE>2)
+  else if (tracefp != NULL)
+    tracerecord(TR_SEND, AorB, &packet, TRO_OK);
+
+  if (TRACING(3))
      printf("          TOLAYER3: scheduling arrival on other side\n");
   insertevent(evptr);
+
+  /* duplication: the copy takes its own chances with loss, corruption and order */
+  if (lk->duplicate > 0 && !duplicating && rnd(RNG_DUPLICATE + dir) < lk->duplicate) {
+     stats.duplicated++;
+     tracef(1, YEL "          TOLAYER3: packet duplicated\n" RESET);
+     duplicating = 1;
+     ntolayer3--;                   /* counts what the protocol sent */
+     tolayer3(AorB, packet);
+     duplicating = 0;
+     }
 }
 
-void tolayer5(int AorB, struct msg datasent)
+/* Give the sender at AorB the messages layer 5 holds for it, oldest */
+/* first, until it blocks layer 5.  A message it drops is forgotten.  */
+void feedlayer5(int AorB)
+{
+  struct port *h = &port[AorB];
+  struct pending *q;
+  struct msg message;
+  int drops;
+
+  while (!h->blocked && h->pendgive < h->pendtail) {
+     q = &h->pending[h->pendgive];
+     memset(msgbuf, q->data, q->length);
+     message.length = q->length;
+     message.data = msgbuf;
+     drops = stats.bufferdrops;
+     ep_output(AorB, message);
+     if (h->blocked)                   /* not taken: offer it again later */
+        break;
+     if (stats.bufferdrops != drops) {
+        memmove(q, q+1, (h->pendtail - h->pendgive - 1)*sizeof(*q));
+        h->pendtail--;
+        continue;
+        }
+     stats.heldwait += simtime - q->time;
+     h->pendgive++;
+     }
+  if (h->pendtail - h->pendgive > stats.heldmax)
+     stats.heldmax = h->pendtail - h->pendgive;
+}
+
+/* The sender at AorB is full (-backpressure 1): layer 5 keeps the message */
+/* it just offered, and the ones after it, until unblocklayer5(AorB)       */
+void blocklayer5(int AorB)
 {
+  if (!port[AorB].blocked)
+     stats.blocks++;
+  port[AorB].blocked = 1;
+  if (TRACING(2))
+     printf("          BLOCKLAYER5: layer 5 at %s waits\n", epname(AorB));
+}
+
+void unblocklayer5(int AorB)
+{
+  port[AorB].blocked = 0;
+}
+
+/* the message is the oldest one sent from endpoint from not delivered */
+/* yet: the same length, and every byte its letter                     */
+int nextmessage(int from, struct msg *m)
+{
+  struct port *h = &port[from];
+  struct pending *q = &h->pending[h->pendhead];
   int i;
-  if (TRACE>2) {
-     printf("          TOLAYER5: data received: ");
-     for (i=0; i<20; i++)
-        printf("%c",datasent.data[i]);
-     printf("\n");
-   }
 
+  if (h->pendhead >= h->pendgive || m->length != q->length)
+     return 0;
+  for (i = 0; i < m->length; i++)
+     if (m->data[i] != q->data)
+        return 0;
+  return 1;
+}
+
+void tolayer5(int AorB, struct msg datasent)
+{
+  struct port *h = &port[AorB ^ 1];       /* the sender at the other end */
+
+  if (nextmessage(AorB ^ 1, &datasent)) {
+     latency[stats.delivered++] = simtime - h->pending[h->pendhead].time;
+     stats.deliveredbytes += datasent.length;
+     h->delivered++;
+     h->deliveredbytes += datasent.length;
+     h->pendhead++;
+     }
+  else
+     stats.duplicates++;
+  if (tracefp != NULL)
+     tracerecord(TR_DELIVER, AorB, NULL, TRO_OK);
+  if (TRACING(3))
+     printf("          TOLAYER5: data received: %.*s\n", datasent.length, datasent.data);
+
+}
+
+
+/************************** PARAMETER SWEEPS *******************************/
+/* -sweep FILE runs the simulation once for every combination of the      */
+/* values in FILE, which holds one "name value value ..." line per swept  */
+/* parameter (names as for -config).  Runs are handed out one at a time   */
+/* to -threads workers; each worker starts every run from a copy of the   */
+/* command-line options, parsed once, applies that run's swept values and */
+/* calls siminit(), so its SIMSTATE is fresh.  The runs are not traced   */
+/* (TRACE 0) and print nothing but why one aborted, on stderr; one CSV    */
+/* row per run is printed, in grid order, once all of them have finished. */
+/****************************************************************************/
+char sweepname[MAXSWEEP][64];
+char sweepval[MAXSWEEP][MAXVALUES][32];
+int nsweepval[MAXSWEEP];
+int nswept = 0;
+long njobs;                    /* runs in the grid */
+long nextjob = 0;              /* next run to hand out */
+pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+char (*sweeprow)[768];         /* result row of each run */
+
+void readsweep(char *file)
+{
+   FILE *fp;
+   char line[1024], *cp, *tok;
+   int i;
+
+   if ((fp = fopen(file, "r")) == NULL) {
+      printf("Cannot open sweep file %s\n", file);
+      exit(1);
+      }
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if ((cp = strchr(line, '#')) != NULL)
+         *cp = '\0';
+      if ((tok = strtok(line, " \t\r\n=,")) == NULL)
+         continue;
+      if (nswept == MAXSWEEP) {
+         printf("%s: more than %d swept parameters\n", file, MAXSWEEP);
+         exit(1);
+         }
+      strncpy(sweepname[nswept], tok, sizeof(sweepname[0])-1);
+      nsweepval[nswept] = 0;
+      while ((tok = strtok(NULL, " \t\r\n=,")) != NULL) {
+         if (nsweepval[nswept] == MAXVALUES) {
+            printf("%s: more than %d values for %s\n", file, MAXVALUES, sweepname[nswept]);
+            exit(1);
+            }
+         strncpy(sweepval[nswept][nsweepval[nswept]++], tok, sizeof(sweepval[0][0])-1);
+         }
+      if (nsweepval[nswept] == 0) {
+         printf("%s: bad sweep line for %s\n", file, sweepname[nswept]);
+         exit(1);
+         }
+      if (strcmp(sweepname[nswept], "tracefile") == 0 || strcmp(sweepname[nswept], "json") == 0
+          || strcmp(sweepname[nswept], "sweep") == 0 || strcmp(sweepname[nswept], "threads") == 0) {
+         printf("%s: %s is the same for every run, it can't be swept\n", file, sweepname[nswept]);
+         exit(1);
+         }
+      for (i = 0; i < nsweepval[nswept]; i++)   /* every value, before the workers run */
+         if (!setparam(sweepname[nswept], sweepval[nswept][i])) {
+            printf("%s: bad sweep line for %s\n", file, sweepname[nswept]);
+            exit(1);
+            }
+      nswept++;
+      }
+   fclose(fp);
+}
+
+void *sweepworker(void *arg)
+{
+   jmp_buf escape;
+   char name[1024], linkcols[256];
+   long job, rest;
+   int k, aborted;
+   float p50, p99, max, fair;
+
+   while (1) {
+      pthread_mutex_lock(&joblock);
+      job = nextjob++;
+      pthread_mutex_unlock(&joblock);
+      if (job >= njobs)
+         return NULL;
+
+      simescape = &escape;
+      simrun = job;
+      aborted = setjmp(escape);
+      if (!aborted) {
+         paramload(&options);
+         for (rest = job, k = nswept-1; k >= 0; k--) {
+            setparam(sweepname[k], sweepval[k][rest % nsweepval[k]]);
+            rest /= nsweepval[k];
+            }
+         TRACE = 0;                      /* nothing would see the trace */
+         siminit();
+         if (tracefile != NULL) {        /* one trace file per run */
+            snprintf(name, sizeof(name), "%s.%ld", tracefile, job);
+            traceopen(name);
+            }
+         initendpoints();
+         simulate();
+         }
+      traceclose();
+      simescape = NULL;
+      simrun = -1;
+      latencystats(&p50, &p99, &max);
+      fair = aborted ? 0.0 : fairness(NULL, NULL, NULL);
+      linkcsv(linkcols, sizeof(linkcols));
+      snprintf(sweeprow[job], sizeof(sweeprow[job]),
+               "%d,%g,%g,%g,%d,%g,%d,%u,%d,%d,%s,%d,%s,%d,%s,%s,%d,%d,%d,%d,%d,%d,%s,%s,%f,%d,%d,%d,%d,"
+               "%d,%d,%d,%f,%f,%f,%ld,%ld,%f,%ld,%ld,%f,%f,%ld,%d,%d,%d,%d,%d,%d,%d,%d,%f,%d,%d,%d,%d,%d,%d,%f,%f,%f,%f,%ld",
+               nsimmax, lossprob, corruptprob, lambda, WINDOW_SIZE, TIME_OUT,
+               BUFFER_SIZE, seed, BIDIRECTIONAL, NENTITY, traffic ? traffic : "pairs", FLOWS,
+               protoname[PROTOCOL], SACK,
+               ADAPTIVE_RTO ? "adaptive" : "fixed", ccname[CONGESTION],
+               BUFFER_MAX, BACKPRESSURE, MSS, MSGLEN, MSGLENMAX, SEQBITS, linkcols,
+               aborted ? "aborted" : "ok",
+               simtime, nsim, ntolayer3, nlost, ncorrupt, stats.malformed, total_received_ACKs,
+               stats.delivered, simtime > 0 ? stats.delivered/simtime : 0.0,
+               simtime > 0 ? stats.deliveredbytes/simtime : 0.0, fair,
+               stats.wirebytes, stats.hdrbytes,
+               stats.wirebytes ? (float)stats.deliveredbytes/stats.wirebytes : 0.0,
+               stats.copies, stats.copybytes,
+               stats.delivered ? (float)stats.copies/stats.delivered : 0.0,
+               stats.delivered ? (float)stats.retransmits/stats.delivered : 0.0,
+               stats.retransbytes, stats.fastretx,
+               stats.naks, stats.duplicates, stats.bufferdrops, stats.bufferhigh,
+               stats.buffergrows, stats.blocks, stats.heldmax, stats.heldwait,
+               stats.queuedrops, stats.badlost, stats.reordered, stats.duplicated, stats.timeouts,
+               stats.spurious, stats.idle, p50, p99, max, stats.clockties);
+      }
+}
+
+/* the link columns of a sweep row; a parameter that differs between */
+/* the directions shows as A-to-B/B-to-A                             */
+void linkcsv(char *buf, int size)
+{
+   struct link *ab = &linkcfg[B], *ba = &linkcfg[A];
+   float v[9][2] = { { ab->bandwidth, ba->bandwidth }, { ab->delay, ba->delay },
+                     { ab->queuemax, ba->queuemax }, { ab->gebad, ba->gebad },
+                     { ab->gegood, ba->gegood }, { ab->badloss, ba->badloss },
+                     { ab->reorder, ba->reorder }, { ab->reorderdepth, ba->reorderdepth },
+                     { ab->duplicate, ba->duplicate } };
+   int i, n;
+
+   if (ab->model == ba->model)
+      n = snprintf(buf, size, "%s", linkname[ab->model]);
+    else
+      n = snprintf(buf, size, "%s/%s", linkname[ab->model], linkname[ba->model]);
+   for (i = 0; i < 9 && n < size; i++)
+      if (v[i][0] == v[i][1])
+         n += snprintf(buf+n, size-n, ",%g", v[i][0]);
+       else
+         n += snprintf(buf+n, size-n, ",%g/%g", v[i][0], v[i][1]);
+}
+
+int sweep()
+{
+   pthread_t *workers;
+   long job;
+   int i;
+
+   paramsave(&options);                /* before readsweep() tries the values */
+   readsweep(sweepfile);
+   for (njobs = 1, i = 0; i < nswept; i++)
+      njobs *= nsweepval[i];
+   if (nthreads <= 0)
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (nthreads > njobs)
+      nthreads = njobs;
+   fprintf(stderr, "Sweeping %ld runs on %d threads\n", njobs, nthreads);
+
+   sweeprow = malloc(njobs * sizeof(*sweeprow));
+   workers = malloc(nthreads * sizeof(pthread_t));
+   for (i = 0; i < nthreads; i++)
+      pthread_create(&workers[i], NULL, sweepworker, NULL);
+   for (i = 0; i < nthreads; i++)
+      pthread_join(workers[i], NULL);
+
+   printf("n,loss,corrupt,lambda,window,timeout,buffer,seed,bidirectional,endpoints,traffic,flows,"
+          "protocol,sack,rto,cc,buffermax,backpressure,mss,msglen,msglenmax,seqbits,"
+          "link,bandwidth,delay,queue,gebad,gegood,badloss,reorder,reorderdepth,duplicate,status,time,nsim,ntolayer3,nlost,ncorrupt,malformed,acks,delivered,goodput,goodput_bytes,fairness,"
+          "wire_bytes,header_bytes,efficiency,copies,copy_bytes,copies_per_msg,"
+          "retransmits_per_msg,retransmit_bytes,fast_retransmits,naks,duplicates,buffer_drops,"
+          "buffer_high,buffer_grows,layer5_blocks,layer5_held_max,layer5_wait,"
+          "queue_drops,burst_lost,reordered,duplicated,timeouts,"
+          "spurious_timeouts,timeout_idle,latency_p50,latency_p99,latency_max,clock_ties\n");
+   for (job = 0; job < njobs; job++)
+      printf("%s\n", sweeprow[job]);
+   return 0;
+}
+
+
+/************************** RUN STATISTICS *********************************/
+
+int floatcmp(const void *a, const void *b)
+{
+   float x = *(const float *)a, y = *(const float *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentiles of the delivery latencies (0 if none) */
+void latencystats(float *p50, float *p99, float *max)
+{
+   int n = stats.delivered;
+
+   *p50 = *p99 = *max = 0.0;
+   if (n == 0)
+      return;
+   qsort(latency, n, sizeof(float), floatcmp);
+   *p50 = latency[(n*50 + 99)/100 - 1];
+   *p99 = latency[(n*99 + 99)/100 - 1];
+   *max = latency[n-1];
+}
+
+#define  FLOWS_LISTED    16    /* flows the text statistics show one by one */
+
+/* Jain's fairness index of the goodput of the endpoints that send,   */
+/* (sum x)^2 / (n sum x^2): 1 when they all get the same, 1/n when one */
+/* gets everything.  Also their least, mean and greatest goodput.      */
+double fairness(double *min, double *mean, double *max)
+{
+   double x, sum = 0.0, sumsq = 0.0, lo = 0.0, hi = 0.0;
+   int i;
+
+   for (i = 0; i < nsources; i++) {
+      x = simtime > 0 ? port[sources[i]].deliveredbytes/simtime : 0.0;
+      if (i == 0 || x < lo)
+         lo = x;
+      if (i == 0 || x > hi)
+         hi = x;
+      sum += x;
+      sumsq += x*x;
+      }
+   if (min != NULL) {
+      *min = lo;
+      *mean = nsources > 0 ? sum/nsources : 0.0;
+      *max = hi;
+      }
+   return sumsq > 0 ? sum*sum/(nsources*sumsq) : 0.0;
+}
+
+/* the end-of-run statistics, as text or as a JSON object */
+void statsreport(FILE *fp, int json)
+{
+   float p50, p99, max, goodput, goodbytes, retx, overhead, efficiency, copies;
+   double fair, fmin, fmean, fmax;
+   struct port *p;
+   int i;
+
+   latencystats(&p50, &p99, &max);
+   fair = fairness(&fmin, &fmean, &fmax);
+   goodput = simtime > 0 ? stats.delivered/simtime : 0.0;
+   goodbytes = simtime > 0 ? stats.deliveredbytes/simtime : 0.0;
+   retx = stats.delivered ? (float)stats.retransmits/stats.delivered : 0.0;
+   overhead = stats.wirebytes ? (float)stats.hdrbytes/stats.wirebytes : 0.0;
+   efficiency = stats.wirebytes ? (float)stats.deliveredbytes/stats.wirebytes : 0.0;
+   copies = stats.delivered ? (float)stats.copies/stats.delivered : 0.0;
+   if (json) {
+      fprintf(fp, "{\n");
+      fprintf(fp, "  \"time\": %f,\n", simtime);
+      fprintf(fp, "  \"messages\": %d,\n", nsim);
+      fprintf(fp, "  \"endpoints\": %d,\n", NENTITY);
+      fprintf(fp, "  \"connections\": %d,\n", nflow);
+      fprintf(fp, "  \"delivered\": %d,\n", stats.delivered);
+      fprintf(fp, "  \"goodput\": %f,\n", goodput);
+      fprintf(fp, "  \"goodput_bytes\": %f,\n", goodbytes);
+      fprintf(fp, "  \"fairness\": %f,\n", fair);
+      fprintf(fp, "  \"flows\": [");
+      for (i = 0; i < nsources; i++) {
+         p = &port[sources[i]];
+         fprintf(fp, "%s\n    { \"conn\": %d, \"from\": %d, \"to\": %d, \"delivered\": %d, "
+                 "\"goodput_bytes\": %f }", i ? "," : "", sources[i] >> 1,
+                 flowtab[sources[i] >> 1].end[sources[i] & 1],
+                 flowtab[sources[i] >> 1].end[!(sources[i] & 1)], p->delivered,
+                 simtime > 0 ? p->deliveredbytes/simtime : 0.0);
+         }
+      fprintf(fp, "\n  ],\n");
+      fprintf(fp, "  \"seqbits\": %d,\n", SEQBITS);
+      fprintf(fp, "  \"header_size\": %d,\n", WIRE_HDR);
+      fprintf(fp, "  \"wire_bytes\": %ld,\n", stats.wirebytes);
+      fprintf(fp, "  \"header_bytes\": %ld,\n", stats.hdrbytes);
+      fprintf(fp, "  \"header_overhead\": %f,\n", overhead);
+      fprintf(fp, "  \"efficiency\": %f,\n", efficiency);
+      fprintf(fp, "  \"copies\": %ld,\n", stats.copies);
+      fprintf(fp, "  \"copy_bytes\": %ld,\n", stats.copybytes);
+      fprintf(fp, "  \"copies_per_msg\": %f,\n", copies);
+      fprintf(fp, "  \"retransmits\": %d,\n", stats.retransmits);
+      fprintf(fp, "  \"retransmits_per_msg\": %f,\n", retx);
+      fprintf(fp, "  \"retransmit_bytes\": %ld,\n", stats.retransbytes);
+      fprintf(fp, "  \"fast_retransmits\": %d,\n", stats.fastretx);
+      fprintf(fp, "  \"naks\": %d,\n", stats.naks);
+      fprintf(fp, "  \"duplicates\": %d,\n", stats.duplicates);
+      fprintf(fp, "  \"buffer_drops\": %d,\n", stats.bufferdrops);
+      fprintf(fp, "  \"buffer_high\": %d,\n", stats.bufferhigh);
+      fprintf(fp, "  \"buffer_grows\": %d,\n", stats.buffergrows);
+      fprintf(fp, "  \"layer5_blocks\": %d,\n", stats.blocks);
+      fprintf(fp, "  \"layer5_held_max\": %d,\n", stats.heldmax);
+      fprintf(fp, "  \"layer5_wait\": %f,\n", stats.heldwait);
+      fprintf(fp, "  \"timeouts\": %d,\n", stats.timeouts);
+      fprintf(fp, "  \"spurious_timeouts\": %d,\n", stats.spurious);
+      fprintf(fp, "  \"timeout_idle\": %f,\n", stats.idle);
+      fprintf(fp, "  \"clock_ties\": %ld,\n", stats.clockties);
+      fprintf(fp, "  \"tolayer3\": %d,\n", ntolayer3);
+      fprintf(fp, "  \"lost\": %d,\n", nlost);
+      fprintf(fp, "  \"queue_drops\": %d,\n", stats.queuedrops);
+      fprintf(fp, "  \"burst_lost\": %d,\n", stats.badlost);
+      fprintf(fp, "  \"reordered\": %d,\n", stats.reordered);
+      fprintf(fp, "  \"duplicated\": %d,\n", stats.duplicated);
+      fprintf(fp, "  \"corrupted\": %d,\n", ncorrupt);
+      fprintf(fp, "  \"malformed\": %d,\n", stats.malformed);
+      fprintf(fp, "  \"latency\": { \"p50\": %f, \"p99\": %f, \"max\": %f }\n",
+              p50, p99, max);
+      fprintf(fp, "}\n");
+      return;
+      }
+   fprintf(fp, " Statistics:\n");
+   fprintf(fp, "   delivered            %d of %d messages\n", stats.delivered, nsim);
+   fprintf(fp, "   goodput              %f msgs (%f bytes) per time unit\n",
+           goodput, goodbytes);
+   if (nsources > 1) {
+      fprintf(fp, "   flows                %d over %d connections, %f / %f / %f bytes per time\n"
+                  "                        unit min/mean/max, Jain's fairness index %f\n",
+              nsources, nflow, fmin, fmean, fmax, fair);
+      for (i = 0; i < nsources && i < FLOWS_LISTED; i++) {
+         p = &port[sources[i]];
+         fprintf(fp, "     %s -> %s%*s %d messages, %f bytes per time unit\n",
+                 epname(sources[i]), epname(sources[i] ^ 1),
+                 14 - (int)(strlen(epname(sources[i])) + strlen(epname(sources[i] ^ 1))), "",
+                 p->delivered, simtime > 0 ? p->deliveredbytes/simtime : 0.0);
+         }
+      if (nsources > FLOWS_LISTED)
+         fprintf(fp, "     ... and %d more\n", nsources - FLOWS_LISTED);
+      }
+   fprintf(fp, "   on the wire          %ld bytes, %.1f%% of them in %d-byte headers (seqbits %d)\n",
+           stats.wirebytes, 100*overhead, WIRE_HDR, SEQBITS);
+   fprintf(fp, "   efficiency           %f delivered bytes per byte on the wire\n", efficiency);
+   fprintf(fp, "   payload copies       %ld (%ld bytes, %f per delivered message)\n",
+           stats.copies, stats.copybytes, copies);
+   fprintf(fp, "   retransmissions      %d (%ld bytes, %f per delivered message)\n",
+           stats.retransmits, stats.retransbytes, retx);
+   fprintf(fp, "   fast retransmits     %d\n", stats.fastretx);
+   fprintf(fp, "   NAKs sent            %d\n", stats.naks);
+   fprintf(fp, "   duplicate deliveries %d\n", stats.duplicates);
+   fprintf(fp, "   buffer-full drops    %d\n", stats.bufferdrops);
+   fprintf(fp, "   sender buffer        %d packets at most, grown %d times\n",
+           stats.bufferhigh, stats.buffergrows);
+   fprintf(fp, "   layer 5 blocked      %d times (%d messages held at most, %f time units waiting)\n",
+           stats.blocks, stats.heldmax, stats.heldwait);
+   fprintf(fp, "   timeouts             %d (%d spurious, %f time units idle before them)\n",
+           stats.timeouts, stats.spurious, stats.idle);
+   fprintf(fp, "   packets to layer 3   %d (%d lost, %d corrupted)\n",
+           ntolayer3, nlost, ncorrupt);
+   if (stats.malformed > 0)
+      fprintf(fp, "   of the corrupted     %d malformed, dropped on arrival\n", stats.malformed);
+   if (stats.queuedrops > 0 || stats.badlost > 0)
+      fprintf(fp, "   of the lost          %d dropped by a full queue, %d in a loss burst\n",
+              stats.queuedrops, stats.badlost);
+   if (stats.reordered > 0 || stats.duplicated > 0)
+      fprintf(fp, "   medium also          held back %d packets, duplicated %d\n",
+              stats.reordered, stats.duplicated);
+   fprintf(fp, "   latency p50/p99/max  %f / %f / %f\n", p50, p99, max);
+   fprintf(fp, "   clock                %ld events at the time of the one before\n",
+           stats.clockties);
+}
+
+
+/************************** BINARY EVENT TRACE *****************************/
+
+void traceopen(char *file)
+{
+   struct traceheader h;
+   int32_t ends[2];
+   int c;
+
+   if ((tracefp = fopen(file, "wb")) == NULL) {
+      simabort("Cannot create trace file %s\n", file);
+      }
+   if (tracebuf == NULL)
+      tracebuf = (struct tracerec *)malloc(TRACE_BUFRECS*sizeof(struct tracerec));
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+   h.byteorder = 0x01020304;
+   h.version = TRACE_VERSION;
+   h.recsize = sizeof(struct tracerec);
+   h.connections = nflow;
+   fwrite(&h, sizeof(h), 1, tracefp);
+   for (c = 0; c < nflow; c++) {
+      ends[0] = flowtab[c].end[0];
+      ends[1] = flowtab[c].end[1];
+      fwrite(ends, sizeof(ends), 1, tracefp);
+      }
+   tracenrec = 0;
+   tracewritten = 0;
+}
+
+void traceflush()
+{
+   fwrite(tracebuf, sizeof(struct tracerec), tracenrec, tracefp);
+   tracewritten += tracenrec;
+   tracenrec = 0;
+}
+
+/* append one record for endpoint e.  arg is the outcome of a TR_SEND  */
+/* and the message number of a TR_LAYER5.  Every field is set, there   */
+/* is no memset, and the entities are left to the decoder: the writes  */
+/* to the file are most of what tracing costs, so the record is kept   */
+/* small.  Callers check tracefp first so tracing costs nothing when   */
+/* it is off.                                                          */
+void tracerecord(int type, int e, struct pkt *packet, int arg)
+{
+   struct tracerec *r;
+
+   if (tracenrec == TRACE_BUFRECS)
+      traceflush();
+   r = &tracebuf[tracenrec++];
+   r->time = simtime;
+   r->endpoint = e;
+   r->type = type;
+   if (packet != NULL) {
+      r->seq = packet->seqnum;
+      r->ack = packet->acknum;
+      r->checksum = packet->checksum;
+      r->flags = (packet->isACK ? TRF_ACK : 0) |
+                 (packet->isACK && packet->acknum == -1 ? TRF_NAK : 0) |
+                 (type == TR_SEND ? arg << TRF_OUTCOME : 0);
+      }
+    else {
+      r->seq = type == TR_LAYER5 ? arg : 0;
+      r->ack = 0;
+      r->checksum = 0;
+      r->flags = 0;
+      }
+}
+
+void traceclose()
+{
+   if (tracefp == NULL)
+      return;
+   traceflush();
+   fclose(tracefp);
+   tracefp = NULL;
 }
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* ******************************************************************
+ TRACE DECODER: prints the binary event traces that project2_gbn and
+ project2_stop_wait write with -tracefile FILE as text or CSV.
+
+   usage: trace_decode [-csv] FILE
+
+ The record layout below must match the one in the simulators.  Traces
+ written on a machine of the other byte order are swapped on reading.
+**********************************************************************/
+
+#define  TRACE_MAGIC     "RTPTRACE"
+#define  TRACE_VERSION   4
+#define  TRACE_BUFRECS   65536  /* records read at a time */
+
+struct traceheader {
+   char magic[8];          /* TRACE_MAGIC */
+   uint32_t byteorder;     /* 0x01020304 as written by the simulator */
+   uint32_t version;       /* TRACE_VERSION */
+   uint32_t recsize;       /* sizeof(struct tracerec) */
+   uint32_t connections;   /* connections in the run */
+};
+
+/* the header is followed by the two entities of each connection */
+/* (int32_t), then the records                                     */
+struct tracerec {           /* 24 bytes */
+   double time;            /* simulation time of the record */
+   int32_t seq;            /* packet seqnum, or message number for TR_LAYER5 */
+   int32_t ack;            /* packet acknum */
+   int32_t endpoint;       /* 2*connection, + 1 for the second end */
+   uint16_t checksum;      /* packet checksum, 16 bits as on the wire */
+   uint8_t type;           /* TR_... */
+   uint8_t flags;          /* TRF_..., and the TRO_... outcome of a TR_SEND */
+};
+
+/* record types */
+#define  TR_LAYER5       0
+#define  TR_SEND         1
+#define  TR_ARRIVE       2
+#define  TR_TIMEOUT      3
+#define  TR_TIMERSTART   4
+#define  TR_TIMERSTOP    5
+#define  TR_DELIVER      6
+
+/* record flags */
+#define  TRF_ACK         1
+#define  TRF_NAK         2
+#define  TRF_OUTCOME     4     /* the outcome is flags >> TRF_OUTCOME */
+
+char *typename[] = { "layer5", "send", "arrive", "timeout", "timerstart",
+                     "timerstop", "deliver" };
+char *outcomename[] = { "ok", "lost", "corrupt", "qdrop" };
+
+uint32_t swap32(uint32_t x)
+{
+   return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+void swaprec(struct tracerec *r)
+{
+   uint32_t w[2];
+
+   memcpy(w, &r->time, sizeof(w));
+   w[0] = swap32(w[0]);
+   w[1] = swap32(w[1]);
+   memcpy(&r->time, &w[1], sizeof(uint32_t));       /* words change places too */
+   memcpy((char *)&r->time + sizeof(uint32_t), &w[0], sizeof(uint32_t));
+   r->seq = swap32(r->seq);
+   r->ack = swap32(r->ack);
+   r->endpoint = swap32(r->endpoint);
+   r->checksum = (uint16_t)(r->checksum << 8 | r->checksum >> 8);
+}
+
+/* the end at entity e of connection conn as the simulators name it: */
+/* A and B, then numbers, and with more than one connection also its  */
+/* number, as in A.12 ("" for entity -1)                              */
+char *entname(int e, int conn, int nconn, char *buf)
+{
+   int n;
+
+   if (e < 0)
+      return "";
+   if (e < 2)
+      n = sprintf(buf, "%c", 'A' + e);
+    else
+      n = sprintf(buf, "%d", e);
+   if (nconn > 1)
+      sprintf(buf + n, ".%d", conn);
+   return buf;
+}
+
+/* ends[2*c] and ends[2*c + 1] are the entities of connection c */
+void printrec(struct tracerec *r, int32_t *ends, int nconn, int csv)
+{
+   char *type, *outcome, *ent, *peer, entbuf[32], peerbuf[32];
+   int pad, conn = r->endpoint >> 1, outc = r->flags >> TRF_OUTCOME;
+
+   type = r->type < sizeof(typename)/sizeof(typename[0]) ? typename[r->type] : "?";
+   outcome = outc < (int)(sizeof(outcomename)/sizeof(outcomename[0])) ? outcomename[outc] : "?";
+   if (r->endpoint >= 0 && conn < nconn) {
+      ent = entname(ends[r->endpoint], conn, nconn, entbuf);
+      peer = entname(ends[r->endpoint ^ 1], conn, nconn, peerbuf);
+      }
+    else
+      ent = peer = "?";
+   if (csv) {
+      printf("%f,%s,%s,%s,%d,%d,%d,%d,%d,%d,%s\n", r->time, type, ent, peer,
+             conn, r->seq, r->ack, r->checksum, (r->flags & TRF_ACK) != 0,
+             (r->flags & TRF_NAK) != 0, r->type == TR_SEND ? outcome : "");
+      return;
+      }
+   printf("%14.6f  %-2s %s", r->time, ent, type);
+   pad = 10 - (int)strlen(type);           /* line up the packet fields */
+   switch (r->type) {
+   case TR_LAYER5:
+      printf("%*s  msg %d for %s", pad, "", r->seq, peer);
+      break;
+   case TR_SEND:
+   case TR_ARRIVE:
+      printf("%*s  seq = %d, ack = %d, checksum = %x%s%s", pad, "", r->seq, r->ack, r->checksum,
+             r->flags & TRF_ACK ? ", ACK" : "", r->flags & TRF_NAK ? ", NAK" : "");
+      if (r->type == TR_SEND)
+         printf("  to %s (%s)", peer, outcome);
+       else
+         printf("  from %s", peer);
+      break;
+   case TR_DELIVER:
+      printf("%*s  from %s", pad, "", peer);
+      break;
+   }
+   putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+   struct traceheader h;
+   struct tracerec *buf;
+   int32_t *ends;
+   FILE *fp;
+   size_t n, i;
+   int csv = 0, swap;
+
+   if (argc == 3 && strcmp(argv[1], "-csv") == 0)
+      csv = 1;
+   else if (argc != 2) {
+      printf("usage: trace_decode [-csv] FILE\n");
+      return 1;
+      }
+   if ((fp = fopen(argv[argc-1], "rb")) == NULL) {
+      printf("Cannot open trace file %s\n", argv[argc-1]);
+      return 1;
+      }
+   if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+      printf("%s is not a trace file\n", argv[argc-1]);
+      return 1;
+      }
+   swap = h.byteorder != 0x01020304;
+   if (swap) {
+      h.version = swap32(h.version);
+      h.recsize = swap32(h.recsize);
+      h.connections = swap32(h.connections);
+      }
+   if (h.version != TRACE_VERSION || h.recsize != sizeof(struct tracerec)) {
+      printf("%s: unsupported trace version %u (record size %u)\n", argv[argc-1],
+             h.version, h.recsize);
+      return 1;
+      }
+
+   ends = (int32_t *)malloc((2*(size_t)h.connections + 1)*sizeof(int32_t));
+   if (fread(ends, sizeof(int32_t), 2*(size_t)h.connections, fp) != 2*(size_t)h.connections) {
+      printf("%s: the connection table is cut short\n", argv[argc-1]);
+      return 1;
+      }
+   if (swap)
+      for (i = 0; i < 2*(size_t)h.connections; i++)
+         ends[i] = swap32(ends[i]);
+
+   if (csv)
+      printf("time,type,entity,peer,conn,seq,ack,checksum,isack,isnak,outcome\n");
+   buf = (struct tracerec *)malloc(TRACE_BUFRECS*sizeof(struct tracerec));
+   while ((n = fread(buf, sizeof(struct tracerec), TRACE_BUFRECS, fp)) > 0)
+      for (i = 0; i < n; i++) {
+         if (swap)
+            swaprec(&buf[i]);
+         printrec(&buf[i], ends, h.connections, csv);
+         }
+   fclose(fp);
+   return 0;
+}